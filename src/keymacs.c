@@ -6,16 +6,17 @@
 #include "keymacs.h"
 
 #include "log.h"
+#include "recorder.h"
 #include "xkey.h"
 
-static BOOL key_handler(XKeyEvent *key_event, KeySym key_sym,
-        unsigned int modifiers);
+static BOOL key_handler(KeySym key_sym, unsigned int modifiers,
+        BOOL is_press);
 
-static unsigned int alt_x_counter = 0;
 static BOOL control_x_mode = FALSE;
 static unsigned int selection_mask = 0;
 
 void keymacs_on_bind_key() {
+    recorder_watch_state(&control_x_mode, &selection_mask);
     // M-x
     xkey_bind_key(XK_X, AltMask, key_handler);
     // C-x
@@ -60,12 +61,8 @@ void keymacs_on_bind_key() {
     xkey_bind_key(XK_G, ControlMask, key_handler);
 }
 
-// FIXME: Keys bound and sent by xkey_send_key() cannot be replayed.
-static BOOL key_handler(XKeyEvent *key_event, KeySym key_sym,
-        unsigned int modifiers) {
-
-    BOOL is_press;
-    Display *display;
+static BOOL key_handler(KeySym key_sym, unsigned int modifiers,
+        BOOL is_press) {
 
     log_info("key_handler: Handling %s%s%s%s",
         modifiers & ControlMask ? "Ctrl + " : "",
@@ -73,24 +70,15 @@ static BOOL key_handler(XKeyEvent *key_event, KeySym key_sym,
         modifiers & AltMask ? "Alt + " : "",
         XKeysymToString(key_sym));
 
-    is_press = key_event->type == KeyPress;
-    display = key_event->display;
     log_info("key_handler: Handling key sym=0x%x, modifiers=0x%x, press=%d",
             key_sym, modifiers, is_press);
 
     if (is_press) {
-        if (alt_x_counter > 0) {
-            // M-x mode
-            --alt_x_counter;
-            log_info("key_handler: M-X counter=%d", alt_x_counter);
-            return FALSE;
-        } else if (key_sym == XK_G && modifiers == ControlMask) {
+        // M-x mode is handled by xkey_pass_through()
+        if (key_sym == XK_G && modifiers == ControlMask) {
             // Quit
-            log_info("key_handler: C-g, quit, M-x counter=%d, C-x mode=%d, selection=%d",
-                    alt_x_counter, control_x_mode,
-                    selection_mask == ShiftMask);
-            // M-x mode handled already
-            //alt_x_counter = FALSE;
+            log_info("key_handler: C-g, quit, C-x mode=%d, selection=%d",
+                    control_x_mode, selection_mask == ShiftMask);
             control_x_mode = FALSE;
             // TODO: Clear selection
             selection_mask = 0;
@@ -102,22 +90,18 @@ static BOOL key_handler(XKeyEvent *key_event, KeySym key_sym,
                     control_x_mode);
             // Edit
             if (key_sym == XK_H && modifiers == 0) {
-                ++alt_x_counter;
-                log_info("key_handler: M-X counter=%d", alt_x_counter);
-                xkey_send_key(key_event->display, XK_A, ControlMask);
+                xkey_send_key(XK_A, ControlMask);
             // Frame
             } else if (key_sym == XK_F && modifiers == ControlMask) {
-                xkey_send_key(key_event->display, XK_O, ControlMask);
+                xkey_send_key(XK_O, ControlMask);
             } else if (key_sym == XK_S && modifiers == ControlMask) {
-                ++alt_x_counter;
-                log_info("key_handler: M-X counter=%d", alt_x_counter);
-                xkey_send_key(key_event->display, XK_S, ControlMask);
+                xkey_send_key(XK_S, ControlMask);
             } else if (key_sym == XK_K && modifiers == 0) {
                 // FIXME: Partially broken: sometimes switches to tty
-                xkey_send_key(key_event->display, XK_F4, ControlMask);
+                xkey_send_key(XK_F4, ControlMask);
             } else if (key_sym == XK_C && modifiers == ControlMask) {
                 // FIXME: Partially broken: sometimes switches to tty
-                xkey_send_key(key_event->display, XK_F4, AltMask);
+                xkey_send_key(XK_F4, AltMask);
             } else {
                 // TODO: Ring a bell
             }
@@ -126,9 +110,7 @@ static BOOL key_handler(XKeyEvent *key_event, KeySym key_sym,
             // Normal mode
             // M-X
             if (key_sym == XK_X && modifiers == AltMask) {
-                ++alt_x_counter;
-                log_info("key_handler: M-X counter=%d",
-                        alt_x_counter);
+                xkey_pass_through(1);
             // C-X
             } else if (key_sym == XK_X && modifiers == ControlMask) {
                 control_x_mode = TRUE;
@@ -136,69 +118,63 @@ static BOOL key_handler(XKeyEvent *key_event, KeySym key_sym,
                         control_x_mode);
             // Navigation
             } else if (key_sym == XK_F && modifiers == ControlMask) {
-                xkey_send_key(display, XK_Right, selection_mask);
+                xkey_send_key(XK_Right, selection_mask);
             } else if (key_sym == XK_B && modifiers == ControlMask) {
-                xkey_send_key(display, XK_Left, selection_mask);
+                xkey_send_key(XK_Left, selection_mask);
             } else if (key_sym == XK_P && modifiers == ControlMask) {
-                xkey_send_key(display, XK_Up, selection_mask);
+                xkey_send_key(XK_Up, selection_mask);
             } else if (key_sym == XK_N && modifiers == ControlMask) {
-                xkey_send_key(display, XK_Down, selection_mask);
+                xkey_send_key(XK_Down, selection_mask);
             } else if (key_sym == XK_A && modifiers == ControlMask) {
-                xkey_send_key(display, XK_Home, selection_mask);
+                xkey_send_key(XK_Home, selection_mask);
             } else if (key_sym == XK_E && modifiers == ControlMask) {
-                xkey_send_key(display, XK_End, selection_mask);
+                xkey_send_key(XK_End, selection_mask);
             } else if (key_sym == XK_V && modifiers == ControlMask) {
-                xkey_send_key(display, XK_Page_Down, selection_mask);
+                xkey_send_key(XK_Page_Down, selection_mask);
             } else if (key_sym == XK_V && modifiers == AltMask) {
-                xkey_send_key(display, XK_Page_Up, selection_mask);
+                xkey_send_key(XK_Page_Up, selection_mask);
             } else if (key_sym == XK_comma && modifiers == (AltMask | ShiftMask)) {
-                xkey_send_key(display, XK_Home, ControlMask | selection_mask);
+                xkey_send_key(XK_Home, ControlMask | selection_mask);
             } else if (key_sym == XK_period && modifiers == (AltMask | ShiftMask)) {
-                xkey_send_key(display, XK_End, ControlMask | selection_mask);
+                xkey_send_key(XK_End, ControlMask | selection_mask);
             } else if (key_sym == XK_F && modifiers == AltMask) {
-                xkey_send_key(display, XK_Right, ControlMask | selection_mask);
+                xkey_send_key(XK_Right, ControlMask | selection_mask);
             } else if (key_sym == XK_B && modifiers == AltMask) {
-                xkey_send_key(display, XK_Left, ControlMask | selection_mask);
+                xkey_send_key(XK_Left, ControlMask | selection_mask);
             // Edit
             } else if (key_sym == XK_space && modifiers == ControlMask) {
                 selection_mask ^= ShiftMask;
                 log_info("key_handler: C-Space, selection=%d",
                         selection_mask == ShiftMask);
             } else if (key_sym == XK_W && modifiers == ControlMask) {
-                ++alt_x_counter;
-                log_info("key_handler: M-X counter=%d", alt_x_counter);
-                xkey_send_key(key_event->display, XK_X, ControlMask);
+                xkey_send_key(XK_X, ControlMask);
             } else if (key_sym == XK_W && modifiers == AltMask) {
-                xkey_send_key(key_event->display, XK_C, ControlMask);
+                xkey_send_key(XK_C, ControlMask);
             } else if (key_sym == XK_Y && modifiers == ControlMask) {
-                ++alt_x_counter;
-                log_info("key_handler: M-X counter=%d", alt_x_counter);
-                xkey_send_key(key_event->display, XK_V, ControlMask);
+                xkey_send_key(XK_V, ControlMask);
             } else if (key_sym == XK_D && modifiers == ControlMask) {
-                xkey_send_key(key_event->display, XK_Delete, 0);
+                xkey_send_key(XK_Delete, 0);
             } else if (key_sym == XK_D && modifiers == AltMask) {
-                xkey_send_key(key_event->display, XK_Delete, ControlMask);
+                xkey_send_key(XK_Delete, ControlMask);
             } else if (key_sym == XK_K && modifiers == ControlMask) {
                 if (selection_mask == 0) {
-                    xkey_send_key(key_event->display, XK_End, ShiftMask);
-                    xkey_send_key(key_event->display, XK_Delete, 0);
+                    xkey_send_key(XK_End, ShiftMask);
+                    xkey_send_key(XK_Delete, 0);
                 } else {
-                    ++alt_x_counter;
-                    log_info("key_handler: M-X counter=%d", alt_x_counter);
-                    xkey_send_key(key_event->display, XK_X, ControlMask);
+                    xkey_send_key(XK_X, ControlMask);
                 }
             } else if (key_sym == XK_slash && modifiers == ControlMask) {
-                xkey_send_key(key_event->display, XK_Z, ControlMask);
+                xkey_send_key(XK_Z, ControlMask);
             // Search
             } else if (key_sym == XK_S && modifiers == ControlMask) {
-                xkey_send_key(key_event->display, XK_F3, 0);
+                xkey_send_key(XK_F3, 0);
             } else if (key_sym == XK_R && modifiers == ControlMask) {
-                xkey_send_key(key_event->display, XK_F3, ShiftMask);
+                xkey_send_key(XK_F3, ShiftMask);
             // Misc
             } else if (key_sym == XK_M && modifiers == ControlMask) {
-                xkey_send_key(key_event->display, XK_Return, 0);
+                xkey_send_key(XK_Return, 0);
             } else if (key_sym == XK_J && modifiers == ControlMask) {
-                xkey_send_key(key_event->display, XK_Return, 0);
+                xkey_send_key(XK_Return, 0);
             } else {
                 // Pass through keys bound for C-x in normal mode
                 return FALSE;
@@ -15,21 +15,54 @@
 
 #include "log.h"
 #include "keymacs.h"
+#include "module.h"
+#include "recorder.h"
 #include "xkey.h"
+#include "xkey_xlib.h"
 
 static void print_help();
 static void trap_finalize();
 static void finalize_handler(int sig);
+static void trap_reload();
+static void reload_handler(int sig);
+static void trap_dump();
+static void dump_handler(int sig);
+static void crash_handler(int sig);
 static void init_daemon();
 
 int main(int argc, char **argv) {
 
-    if (argc == 2) {
-        if (strcmp(argv[1], "-d") == 0
-                || strcmp(argv[1], "--daemon") == 0) {
-            init_daemon();
-        } else if (strcmp(argv[1], "-h") == 0
-                || strcmp(argv[1], "--help") == 0) {
+    BOOL is_daemon = FALSE;
+    int i;
+
+    xkey_use_backend(&xkey_xlib_backend);
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-d") == 0
+                || strcmp(argv[i], "--daemon") == 0) {
+            is_daemon = TRUE;
+        } else if (strcmp(argv[i], "-k") == 0
+                || strcmp(argv[i], "--keyboard") == 0) {
+            if (i + 1 == argc) {
+                log_error("main: Missing keyboard name");
+                printf("\n");
+                print_help();
+                return EXIT_FAILURE;
+            }
+            ++i;
+            xkey_select_device(argv[i]);
+        } else if (strcmp(argv[i], "-m") == 0
+                || strcmp(argv[i], "--module") == 0) {
+            if (i + 1 == argc) {
+                log_error("main: Missing module path");
+                printf("\n");
+                print_help();
+                return EXIT_FAILURE;
+            }
+            ++i;
+            module_add_path(argv[i]);
+        } else if (strcmp(argv[i], "-h") == 0
+                || strcmp(argv[i], "--help") == 0) {
             print_help();
             return EXIT_SUCCESS;
         } else {
@@ -38,18 +71,23 @@ int main(int argc, char **argv) {
             print_help();
             return EXIT_FAILURE;
         }
-    } else if (argc > 2) {
-        log_error("main: Too many arguments");
-        printf("\n");
-        print_help();
-        return EXIT_FAILURE;
     }
 
+    if (is_daemon) {
+        init_daemon();
+    }
+
+    recorder_initialize();
+
     xkey_initialize();
 
     keymacs_on_bind_key();
 
+    module_initialize();
+
     trap_finalize();
+    trap_reload();
+    trap_dump();
 
     xkey_loop();
 
@@ -59,16 +97,20 @@ int main(int argc, char **argv) {
 static void print_help() {
     printf("xkeymacs - X11 KEYboard MACroS\n"
            "Usage:\n"
-           "\txkeymacs [OPTION]\n"
+           "\txkeymacs [OPTION]...\n"
            "Options:\n"
            "\t-d, --daemon\n"
            "\t\tstart xkeymacs as daemon\n"
+           "\t-k, --keyboard NAME\n"
+           "\t\tonly remap the XInput2 keyboard NAME, may be repeated\n"
+           "\t-m, --module PATH\n"
+           "\t\tload the handler module at PATH, may be repeated, SIGHUP\n"
+           "\t\treloads the modules\n"
            "\t-h, --help\n"
            "\t\tdisplay this help and exit\n");
 }
 
 static void trap_finalize() {
-    signal(SIGHUP, finalize_handler);
     signal(SIGINT, finalize_handler);
     signal(SIGQUIT, finalize_handler);
     signal(SIGTERM, finalize_handler);
@@ -77,12 +119,48 @@ static void trap_finalize() {
 static void finalize_handler(int sig) {
 
     log_info("finalize_handler: Finalizing, signal=%d", sig);
+    module_finalize();
     xkey_finalize();
+    recorder_finalize();
 
     log_info("finalize_handler: Exiting");
     exit(EXIT_SUCCESS);
 }
 
+/**
+ * SIGHUP reloads the modules, from the event loop since unbinding keys
+ * talks to the X server.
+ */
+static void trap_reload() {
+    xkey_handle_signal(SIGHUP, reload_handler);
+}
+
+static void reload_handler(int sig) {
+    module_reload();
+}
+
+/**
+ * SIGUSR1 dumps the recent key events, and so does a crash.
+ */
+static void trap_dump() {
+    signal(SIGUSR1, dump_handler);
+    signal(SIGSEGV, crash_handler);
+    signal(SIGBUS, crash_handler);
+    signal(SIGFPE, crash_handler);
+    signal(SIGILL, crash_handler);
+    signal(SIGABRT, crash_handler);
+}
+
+static void dump_handler(int sig) {
+    recorder_dump();
+}
+
+static void crash_handler(int sig) {
+    recorder_dump();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
 /**
  * Implemented according to man page daemon(7).
  */
@@ -0,0 +1,294 @@
+/**
+ * @file module.c
+ * @author Zhang Hai
+ */
+
+#include "module.h"
+
+#include <time.h>
+
+#include <dlfcn.h>
+
+#include "log.h"
+#include "xkey.h"
+
+#define MODULE_PATHS_MAX 16
+#define MODULE_BOUND_KEYS_MAX 256
+// A handler taking longer than this flags its module as slow.
+#define MODULE_SLOW_NANOSECONDS 1000000L
+
+static void load_module(char *path);
+static void unbind_module_keys(unsigned int module_index);
+static const char *get_module_name(module_t *module);
+static int bind_key(unsigned long key_sym, unsigned int modifiers,
+        module_handler_t handler);
+static void send_keys(const module_key_t *keys, unsigned int count);
+static void pass_through(unsigned int count);
+static void send_text(const char *text);
+static BOOL key_handler(KeySym key_sym, unsigned int modifiers,
+        BOOL press);
+static long get_nanoseconds();
+
+static char *paths[MODULE_PATHS_MAX];
+static unsigned int paths_count = 0;
+
+static struct {
+    char *path;
+    void *handle;
+    module_t *module;
+    unsigned long slow_count;
+} modules[MODULE_PATHS_MAX];
+static unsigned int modules_count = 0;
+
+static struct {
+    KeySym key_sym;
+    unsigned int modifiers;
+    module_handler_t handler;
+    unsigned int module_index;
+    unsigned long handled_count;
+    long nanoseconds_total;
+    long nanoseconds_max;
+} bound_keys[MODULE_BOUND_KEYS_MAX];
+static unsigned int bound_keys_count = 0;
+
+static module_host_t host;
+// The module being initialized, which bindings are attributed to.
+static unsigned int initializing_module_index;
+
+/**
+ * Must be called before module_initialize().
+ */
+void module_add_path(char *path) {
+
+    if (paths_count == MODULE_PATHS_MAX) {
+        log_warn("module_add_path: Too many modules, ignoring %s", path);
+        return;
+    }
+    paths[paths_count] = path;
+    ++paths_count;
+}
+
+/**
+ * Loads the modules added, must be called after xkey_initialize().
+ */
+void module_initialize() {
+
+    int i;
+
+    host.abi_version = MODULE_ABI_VERSION;
+    host.size = sizeof(host);
+    host.control_mask = ControlMask;
+    host.shift_mask = ShiftMask;
+    host.alt_mask = AltMask;
+    host.bind_key = bind_key;
+    host.send_keys = send_keys;
+    host.pass_through = pass_through;
+    host.send_text = send_text;
+
+    for (i = 0; i < paths_count; ++i) {
+        load_module(paths[i]);
+    }
+}
+
+static void load_module(char *path) {
+
+    void *handle;
+    module_t *module;
+
+    handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) {
+        log_error("load_module: dlopen failed: %s", dlerror());
+        return;
+    }
+    module = dlsym(handle, MODULE_SYMBOL);
+    if (module == NULL) {
+        log_error("load_module: No %s in %s", MODULE_SYMBOL, path);
+        dlclose(handle);
+        return;
+    }
+    if (module->abi_version != MODULE_ABI_VERSION) {
+        log_error("load_module: ABI version mismatch: %s has %u, expected %u",
+                path, module->abi_version, MODULE_ABI_VERSION);
+        dlclose(handle);
+        return;
+    }
+
+    modules[modules_count].path = path;
+    modules[modules_count].handle = handle;
+    modules[modules_count].module = module;
+    modules[modules_count].slow_count = 0;
+    initializing_module_index = modules_count;
+    ++modules_count;
+
+    if (!module->initialize(&host)) {
+        log_error("load_module: Module %s failed to initialize",
+                get_module_name(module));
+        // Its handlers must not outlive the handle.
+        unbind_module_keys(initializing_module_index);
+        --modules_count;
+        dlclose(handle);
+        return;
+    }
+    log_info("load_module: Loaded module %s from %s",
+            get_module_name(module), path);
+}
+
+static void unbind_module_keys(unsigned int module_index) {
+
+    int i, j = 0;
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].module_index == module_index) {
+            xkey_unbind_key(bound_keys[i].key_sym, bound_keys[i].modifiers,
+                    key_handler);
+        } else {
+            bound_keys[j] = bound_keys[i];
+            ++j;
+        }
+    }
+    bound_keys_count = j;
+}
+
+static const char *get_module_name(module_t *module) {
+    return module->name != NULL ? module->name : "(unnamed)";
+}
+
+/**
+ * Finalizes and unloads every module, then loads them again from their
+ * paths. Must not be called from a signal handler or a key handler.
+ */
+void module_reload() {
+
+    int i;
+
+    log_info("module_reload: Reloading %u modules", paths_count);
+    module_finalize();
+    for (i = modules_count - 1; i >= 0; --i) {
+        unbind_module_keys(i);
+        dlclose(modules[i].handle);
+    }
+    modules_count = 0;
+
+    for (i = 0; i < paths_count; ++i) {
+        load_module(paths[i]);
+    }
+}
+
+void module_finalize() {
+
+    int i;
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].handled_count == 0) {
+            continue;
+        }
+        log_info("module_finalize: %s %s modifiers=0x%x, handled=%lu, nanoseconds=%ld/%ld (average/max)",
+                get_module_name(modules[bound_keys[i].module_index].module),
+                XKeysymToString(bound_keys[i].key_sym),
+                bound_keys[i].modifiers, bound_keys[i].handled_count,
+                bound_keys[i].nanoseconds_total
+                / (long)bound_keys[i].handled_count,
+                bound_keys[i].nanoseconds_max);
+    }
+
+    for (i = 0; i < modules_count; ++i) {
+        if (modules[i].slow_count > 0) {
+            log_warn("module_finalize: Module %s was slow %lu times",
+                    get_module_name(modules[i].module),
+                    modules[i].slow_count);
+        }
+        if (modules[i].module->finalize != NULL) {
+            modules[i].module->finalize();
+        }
+        // Not closing the handle, handlers may still be called until
+        // we exit or module_reload() unbinds them.
+    }
+}
+
+static int bind_key(unsigned long key_sym, unsigned int modifiers,
+        module_handler_t handler) {
+
+    if (bound_keys_count == MODULE_BOUND_KEYS_MAX) {
+        log_warn("bind_key: Too many keys, ignoring key sym=0x%lx",
+                key_sym);
+        return FALSE;
+    }
+    // Also rejects keys bound by another module or by keymacs.
+    if (!xkey_bind_key(key_sym, modifiers, key_handler)) {
+        return FALSE;
+    }
+    bound_keys[bound_keys_count].key_sym = key_sym;
+    bound_keys[bound_keys_count].modifiers = modifiers
+            & ~(LockMask | NumLockMask | ScrollLockMask);
+    bound_keys[bound_keys_count].handler = handler;
+    bound_keys[bound_keys_count].module_index = initializing_module_index;
+    bound_keys[bound_keys_count].handled_count = 0;
+    bound_keys[bound_keys_count].nanoseconds_total = 0;
+    bound_keys[bound_keys_count].nanoseconds_max = 0;
+    ++bound_keys_count;
+    return TRUE;
+}
+
+static void send_keys(const module_key_t *keys, unsigned int count) {
+
+    int i;
+
+    for (i = 0; i < count; ++i) {
+        xkey_send_key(keys[i].key_sym, keys[i].modifiers);
+    }
+}
+
+static void pass_through(unsigned int count) {
+    xkey_pass_through(count);
+}
+
+static void send_text(const char *text) {
+    xkey_send_text((char *)text);
+}
+
+/**
+ * Dispatches to the module handler, accounting for its latency.
+ */
+static BOOL key_handler(KeySym key_sym, unsigned int modifiers,
+        BOOL press) {
+
+    int i;
+    long start, nanoseconds;
+    BOOL handled;
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].key_sym == key_sym
+                && bound_keys[i].modifiers == modifiers) {
+            break;
+        }
+    }
+    if (i == bound_keys_count) {
+        return FALSE;
+    }
+
+    start = get_nanoseconds();
+    handled = bound_keys[i].handler(key_sym, modifiers, press) != 0;
+    nanoseconds = get_nanoseconds() - start;
+
+    ++bound_keys[i].handled_count;
+    bound_keys[i].nanoseconds_total += nanoseconds;
+    if (nanoseconds > bound_keys[i].nanoseconds_max) {
+        bound_keys[i].nanoseconds_max = nanoseconds;
+    }
+    if (nanoseconds > MODULE_SLOW_NANOSECONDS) {
+        ++modules[bound_keys[i].module_index].slow_count;
+        log_warn("key_handler: Slow module %s: key sym=0x%lx, modifiers=0x%x, nanoseconds=%ld",
+                get_module_name(modules[bound_keys[i].module_index].module),
+                key_sym, modifiers, nanoseconds);
+    }
+
+    return handled;
+}
+
+static long get_nanoseconds() {
+
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000L + time.tv_nsec;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file module.h
+ * @author Zhang Hai
+ *
+ * Stable C ABI for loadable handler modules. A module is a shared
+ * object exporting a module_t named MODULE_SYMBOL, and may only rely
+ * on this header. Fields are only ever appended, and
+ * MODULE_ABI_VERSION is bumped on any incompatible change.
+ *
+ * A module built against a newer header may be loaded by an older
+ * xkeymacs, so it must check MODULE_HOST_HAS() before using any
+ * module_host_t member appended after send_text.
+ */
+
+#ifndef _MODULE_H_
+#define _MODULE_H_
+
+#include <stddef.h>
+
+#define MODULE_ABI_VERSION 2
+
+#define MODULE_SYMBOL "xkeymacs_module"
+
+/**
+ * Returns nonzero if the key was handled, or zero to replay it to the
+ * focused window.
+ */
+typedef int (*module_handler_t)(unsigned long key_sym,
+        unsigned int modifiers, int press);
+
+typedef struct {
+    unsigned long key_sym;
+    unsigned int modifiers;
+} module_key_t;
+
+/**
+ * Provided by xkeymacs to modules.
+ */
+typedef struct {
+    unsigned int abi_version;
+    // sizeof(module_host_t) in the xkeymacs loading the module.
+    unsigned int size;
+    unsigned int control_mask;
+    unsigned int shift_mask;
+    unsigned int alt_mask;
+    // Returns zero on failure, including when the key is already bound
+    // by xkeymacs or another module.
+    int (*bind_key)(unsigned long key_sym, unsigned int modifiers,
+            module_handler_t handler);
+    // Injects the keys in order straight from the array given.
+    void (*send_keys)(const module_key_t *keys, unsigned int count);
+    void (*pass_through)(unsigned int count);
+    // Types the UTF-8 text regardless of the modifiers held.
+    void (*send_text)(const char *text);
+} module_host_t;
+
+#define MODULE_HOST_HAS(host, member) ((host)->size >= offsetof(module_host_t, member) + sizeof((host)->member))
+
+/**
+ * Exported by modules.
+ */
+typedef struct {
+    unsigned int abi_version;
+    const char *name;
+    // Binds keys through the host, returns zero on failure.
+    int (*initialize)(const module_host_t *host);
+    void (*finalize)();
+} module_t;
+
+void module_add_path(char *path);
+
+void module_initialize();
+
+void module_finalize();
+
+void module_reload();
+
+#endif /* _MODULE_H_ */
@@ -0,0 +1,225 @@
+/**
+ * @file recorder.c
+ * @author Zhang Hai
+ */
+
+#include "recorder.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define RECORDER_MAGIC "XKMR"
+#define RECORDER_VERSION 2
+
+static BOOL get_directory(char *directory, size_t size);
+static void write_all(int fd, void *buffer, size_t size);
+
+static recorder_record_t records[RECORDER_RECORDS_MAX];
+// Total number of records begun, the current one is at
+// records_total % RECORDER_RECORDS_MAX.
+static unsigned long records_total = 0;
+static recorder_record_t *record = NULL;
+
+static unsigned int *watched_pass_through_count = NULL;
+static BOOL *watched_control_x_mode = NULL;
+static unsigned int *watched_selection_mask = NULL;
+
+static char dump_path[PATH_MAX];
+static int dump_fd = -1;
+static volatile sig_atomic_t dumped = FALSE;
+
+/**
+ * Opens the dump file up front, so that recorder_dump() stays
+ * async-signal-safe. Must be called after daemonizing.
+ */
+void recorder_initialize() {
+
+    char directory[PATH_MAX];
+
+    if (!get_directory(directory, sizeof(directory))) {
+        return;
+    }
+    if (snprintf(dump_path, sizeof(dump_path), "%s/xkeymacs.%d.rec",
+            directory, (int)getpid()) >= sizeof(dump_path)) {
+        log_error("recorder_initialize: Path too long, not recording");
+        return;
+    }
+
+    // Never follow or reuse what may have been planted there.
+    unlink(dump_path);
+    dump_fd = open(dump_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW
+            | O_CLOEXEC, 0600);
+    if (dump_fd == -1) {
+        log_error("recorder_initialize: Cannot open %s: %s", dump_path,
+                strerror(errno));
+        return;
+    }
+    log_info("recorder_initialize: Dumping to %s", dump_path);
+}
+
+/**
+ * Removes the dump file if nothing was ever dumped, async-signal-safe.
+ */
+void recorder_finalize() {
+
+    if (dump_fd == -1) {
+        return;
+    }
+    close(dump_fd);
+    dump_fd = -1;
+    if (!dumped) {
+        unlink(dump_path);
+    }
+}
+
+/**
+ * Uses $XDG_RUNTIME_DIR, or else a directory of our own under /tmp
+ * which nobody else may write to.
+ */
+static BOOL get_directory(char *directory, size_t size) {
+
+    char *runtime_directory = getenv("XDG_RUNTIME_DIR");
+    struct stat status;
+
+    if (runtime_directory != NULL && runtime_directory[0] == '/'
+            && strlen(runtime_directory) < size) {
+        strcpy(directory, runtime_directory);
+        return TRUE;
+    }
+
+    snprintf(directory, size, "/tmp/xkeymacs-%d", (int)getuid());
+    if (mkdir(directory, 0700) == -1 && errno != EEXIST) {
+        log_error("get_directory: Cannot create %s: %s", directory,
+                strerror(errno));
+        return FALSE;
+    }
+    if (lstat(directory, &status) == -1 || !S_ISDIR(status.st_mode)
+            || status.st_uid != getuid()
+            || (status.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+        log_error("get_directory: %s is not a private directory, not recording",
+                directory);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void recorder_watch_pass_through(unsigned int *pass_through_count) {
+    watched_pass_through_count = pass_through_count;
+}
+
+void recorder_watch_state(BOOL *control_x_mode,
+        unsigned int *selection_mask) {
+    watched_control_x_mode = control_x_mode;
+    watched_selection_mask = selection_mask;
+}
+
+void recorder_begin(unsigned long time, unsigned int key_code,
+        unsigned int modifiers, BOOL press, int device_id) {
+
+    record = &records[records_total % RECORDER_RECORDS_MAX];
+    ++records_total;
+
+    memset(record, 0, sizeof(*record));
+    record->time = time;
+    record->key_code = key_code;
+    record->modifiers = modifiers;
+    record->press = press;
+    record->device_id = device_id;
+}
+
+void recorder_add_key(unsigned int key_code, BOOL press) {
+
+    if (record == NULL) {
+        return;
+    }
+    if (record->sent_keys_count == RECORDER_SENT_KEYS_MAX) {
+        if (record->sent_keys_dropped < UINT8_MAX) {
+            ++record->sent_keys_dropped;
+        }
+        return;
+    }
+    record->sent_keys[record->sent_keys_count].key_code = key_code;
+    record->sent_keys[record->sent_keys_count].press = press;
+    ++record->sent_keys_count;
+}
+
+/**
+ * Completes the current record with the handler decision and the state
+ * left behind by the handler.
+ */
+void recorder_end(unsigned long key_sym, int decision) {
+
+    if (record == NULL) {
+        return;
+    }
+    record->key_sym = key_sym;
+    record->decision = decision;
+    if (watched_pass_through_count != NULL) {
+        record->pass_through_count = *watched_pass_through_count;
+    }
+    if (watched_control_x_mode != NULL) {
+        record->control_x_mode = *watched_control_x_mode;
+        record->selection_mask = *watched_selection_mask;
+    }
+    record = NULL;
+}
+
+/**
+ * Writes the ring in binary form, async-signal-safe.
+ */
+void recorder_dump() {
+
+    recorder_header_t header;
+    unsigned long first;
+    int fd = dump_fd;
+
+    if (fd == -1 || lseek(fd, 0, SEEK_SET) == -1
+            || ftruncate(fd, 0) == -1) {
+        return;
+    }
+    dumped = TRUE;
+
+    memcpy(header.magic, RECORDER_MAGIC, sizeof(header.magic));
+    header.version = RECORDER_VERSION;
+    header.record_size = sizeof(recorder_record_t);
+    header.records_count = records_total < RECORDER_RECORDS_MAX
+            ? records_total : RECORDER_RECORDS_MAX;
+    header.records_total = records_total;
+    write_all(fd, &header, sizeof(header));
+
+    first = (records_total - header.records_count) % RECORDER_RECORDS_MAX;
+    if (first + header.records_count <= RECORDER_RECORDS_MAX) {
+        write_all(fd, &records[first],
+                header.records_count * sizeof(recorder_record_t));
+    } else {
+        write_all(fd, &records[first],
+                (RECORDER_RECORDS_MAX - first) * sizeof(recorder_record_t));
+        write_all(fd, records,
+                (first + header.records_count - RECORDER_RECORDS_MAX)
+                * sizeof(recorder_record_t));
+    }
+}
+
+static void write_all(int fd, void *buffer, size_t size) {
+
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, buffer, size);
+        if (written <= 0) {
+            return;
+        }
+        buffer = (char *)buffer + written;
+        size -= written;
+    }
+}
@@ -0,0 +1,74 @@
+/**
+ * @file recorder.h
+ * @author Zhang Hai
+ */
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+#define RECORDER_RECORDS_MAX 1024
+#define RECORDER_SENT_KEYS_MAX 16
+
+#define RECORDER_DECISION_UNHANDLED 0
+#define RECORDER_DECISION_SYNC 1
+#define RECORDER_DECISION_REPLAY 2
+#define RECORDER_DECISION_PASS_THROUGH 3
+
+typedef struct {
+    uint8_t key_code;
+    uint8_t press;
+} recorder_key_t;
+
+/**
+ * One handled key event, written to the dump as is.
+ */
+typedef struct {
+    uint32_t time;
+    uint32_t key_sym;
+    uint32_t modifiers;
+    uint32_t pass_through_count;
+    uint32_t selection_mask;
+    int16_t device_id;
+    uint8_t key_code;
+    uint8_t press;
+    uint8_t decision;
+    uint8_t control_x_mode;
+    uint8_t sent_keys_count;
+    uint8_t sent_keys_dropped;
+    recorder_key_t sent_keys[RECORDER_SENT_KEYS_MAX];
+} recorder_record_t;
+
+/**
+ * Header of the dump, followed by the records from oldest to newest.
+ */
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t records_count;
+    uint32_t records_total;
+} recorder_header_t;
+
+void recorder_initialize();
+
+void recorder_finalize();
+
+void recorder_watch_pass_through(unsigned int *pass_through_count);
+
+void recorder_watch_state(BOOL *control_x_mode,
+        unsigned int *selection_mask);
+
+void recorder_begin(unsigned long time, unsigned int key_code,
+        unsigned int modifiers, BOOL press, int device_id);
+
+void recorder_add_key(unsigned int key_code, BOOL press);
+
+void recorder_end(unsigned long key_sym, int decision);
+
+void recorder_dump();
+
+#endif /* _RECORDER_H_ */
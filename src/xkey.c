@@ -5,340 +5,219 @@
 
 #include "xkey.h"
 
-#include <stdlib.h>
-
-#include <X11/extensions/XTest.h>
-#include <X11/XKBlib.h>
+#include <string.h>
 
 #include "log.h"
 
-#define XKEY_BOUND_KEYS_MAX 256
-
-#define XKEY_NORMALIZE_MODIFIERS(modifiers) (modifiers & ~(LockMask | NumLockMask | ScrollLockMask))
+#define XKEY_SIGNALS_MAX 8
 
-static void initialize_modifier_masks();
-static void initialize_modifier_states();
-static void grab_key(KeyCode key_code, unsigned int modifiers);
-static void update_modifier_states();
+static void catch_signal(int sig);
 
 unsigned int NumLockMask;
 unsigned int ScrollLockMask;
 unsigned int AltMask;
 
-static Display *display;
-static Window window;
-
-static KeyCode control_l_key_code;
-static KeyCode control_r_key_code;
-static KeyCode alt_l_key_code;
-static KeyCode alt_r_key_code;
-static KeyCode shift_l_key_code;
-static KeyCode shift_r_key_code;
-static BOOL control_l_pressed;
-static BOOL control_r_pressed;
-static BOOL alt_l_pressed;
-static BOOL alt_r_pressed;
-static BOOL shift_l_pressed;
-static BOOL shift_r_pressed;
+static xkey_backend_t *backend = NULL;
 
 static struct {
-    KeySym key_sym;
-    KeyCode key_code;
-    unsigned int modifiers;
-    xkey_handler_t handler;
-} bound_keys[XKEY_BOUND_KEYS_MAX];
-static unsigned int bound_keys_count = 0;
+    int sig;
+    xkey_signal_handler_t handler;
+    volatile sig_atomic_t caught;
+} signals[XKEY_SIGNALS_MAX];
+static unsigned int signals_count = 0;
+
+/**
+ * Must be called before any other xkey function, e.g. with
+ * xkey_xlib_backend.
+ */
+void xkey_use_backend(xkey_backend_t *use_backend) {
+    backend = use_backend;
+}
+
+void xkey_select_device(char *device_name) {
+    backend->select_device(device_name);
+}
 
 void xkey_initialize() {
+    backend->initialize();
+}
 
-    display= XOpenDisplay(NULL);
-    if (display == NULL) {
-        log_error("xkey_initialize: XOpenDisplay returned null");
-        exit(EXIT_FAILURE);
-    }
-    window = DefaultRootWindow(display);
+void xkey_finalize() {
+    backend->finalize();
+}
 
-    initialize_modifier_masks();
+/**
+ * Returns FALSE if the key is already bound, each key event goes to one
+ * handler only.
+ */
+BOOL xkey_bind_key(KeySym key_sym, unsigned int modifiers,
+        xkey_handler_t handler) {
+    return backend->bind_key(NULL, key_sym, modifiers, handler);
+}
 
-    initialize_modifier_states();
+BOOL xkey_bind_device_key(char *device_name, KeySym key_sym,
+        unsigned int modifiers, xkey_handler_t handler) {
+    return backend->bind_key(device_name, key_sym, modifiers, handler);
 }
 
-static void initialize_modifier_masks() {
+void xkey_unbind_key(KeySym key_sym, unsigned int modifiers,
+        xkey_handler_t handler) {
+    backend->unbind_key(key_sym, modifiers, handler);
+}
 
-    static unsigned int mask_table[8] = {
-            ShiftMask, LockMask, ControlMask, Mod1Mask, Mod2Mask,
-            Mod3Mask, Mod4Mask, Mod5Mask
-    };
+void xkey_pass_through(unsigned int count) {
+    backend->pass_through(count);
+}
 
-    XModifierKeymap *modifier_keymap;
-    KeyCode num_lock_code, scroll_lock_code, alt_l_code;
-    int i, key_count;
+void xkey_send_key(KeySym key_sym, unsigned int modifiers) {
+    backend->send_key(key_sym, modifiers);
+}
 
-    num_lock_code = XKeysymToKeycode(display, XK_Num_Lock);
-    scroll_lock_code = XKeysymToKeycode(display, XK_Scroll_Lock);
-    alt_l_code = XKeysymToKeycode(display, XK_Alt_L);
+/**
+ * Types the UTF-8 text as is, regardless of the modifier keys held and
+ * of Caps Lock.
+ */
+void xkey_send_text(char *text) {
+    backend->send_text(text);
+}
 
-    modifier_keymap = XGetModifierMapping(display);
-    if (modifier_keymap == NULL) {
-        // Handle critical error.
+/**
+ * Decodes the next UTF-8 character of the text and advances past it.
+ * Returns NoSymbol for malformed input and control characters other
+ * than newline and tab.
+ */
+KeySym xkey_next_text_key_sym(char **text) {
+
+    unsigned char *bytes = (unsigned char *)*text;
+    unsigned long code_point;
+    int length, i;
+
+    if (bytes[0] < 0x80) {
+        code_point = bytes[0];
+        length = 1;
+    } else if ((bytes[0] & 0xe0) == 0xc0) {
+        code_point = bytes[0] & 0x1f;
+        length = 2;
+    } else if ((bytes[0] & 0xf0) == 0xe0) {
+        code_point = bytes[0] & 0x0f;
+        length = 3;
+    } else if ((bytes[0] & 0xf8) == 0xf0) {
+        code_point = bytes[0] & 0x07;
+        length = 4;
+    } else {
+        ++*text;
+        return NoSymbol;
     }
-
-    key_count = 8 * modifier_keymap->max_keypermod;
-    for (i = 0; i < key_count; ++i) {
-        if (modifier_keymap->modifiermap[i] == num_lock_code) {
-            NumLockMask = mask_table[i / modifier_keymap->max_keypermod];
-        } else if (modifier_keymap->modifiermap[i] == scroll_lock_code) {
-            ScrollLockMask = mask_table[i / modifier_keymap->max_keypermod];
-        } else if (modifier_keymap->modifiermap[i] == alt_l_code) {
-            AltMask = mask_table[i / modifier_keymap->max_keypermod];
+    for (i = 1; i < length; ++i) {
+        if ((bytes[i] & 0xc0) != 0x80) {
+            *text += i;
+            return NoSymbol;
         }
+        code_point = (code_point << 6) | (bytes[i] & 0x3f);
+    }
+    *text += length;
+
+    if (code_point == '\n') {
+        return XK_Return;
+    } else if (code_point == '\t') {
+        return XK_Tab;
+    } else if (code_point < 0x20
+            || (code_point >= 0x7f && code_point < 0xa0)) {
+        return NoSymbol;
+    } else if (code_point < 0x100) {
+        // Latin-1 key syms are their code points.
+        return code_point;
+    } else {
+        return 0x01000000 | code_point;
     }
-
-    XFreeModifiermap(modifier_keymap);
 }
 
-static void initialize_modifier_states() {
-    control_l_key_code = XKeysymToKeycode(display, XK_Control_L);
-    control_r_key_code = XKeysymToKeycode(display, XK_Control_R);
-    alt_l_key_code = XKeysymToKeycode(display, XK_Alt_L);
-    alt_r_key_code = XKeysymToKeycode(display, XK_Alt_R);
-    shift_l_key_code = XKeysymToKeycode(display, XK_Shift_L);
-    shift_r_key_code = XKeysymToKeycode(display, XK_Shift_R);
+void xkey_loop() {
+    backend->loop();
 }
 
-void xkey_finalize() {
-    XUngrabKey(display, AnyKey, AnyModifier, window);
-    XUngrabKeyboard(display, CurrentTime);
-    // The following line causes application to hang, since we are
-    // exiting we just ignore it.
-    //XCloseDisplay(display);
+/**
+ * Handles the key events pending and returns, instead of looping
+ * forever.
+ */
+void xkey_process_pending() {
+    backend->process_pending();
 }
 
-void xkey_bind_key(KeySym key_sym, unsigned int modifiers,
-        xkey_handler_t handler) {
+/**
+ * Has the handler called from the event loop instead of from the signal
+ * handler, so that it may unbind keys and talk to the X server. The
+ * signal is blocked except while the loop waits for events.
+ */
+void xkey_handle_signal(int sig, xkey_signal_handler_t handler) {
 
-    KeyCode key_code = XKeysymToKeycode(display, key_sym);
-    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+    sigset_t mask;
+    struct sigaction action;
 
-    grab_key(key_code, modifiers);
+    if (signals_count == XKEY_SIGNALS_MAX) {
+        log_warn("xkey_handle_signal: Too many signals, ignoring signal=%d",
+                sig);
+        return;
+    }
 
-    bound_keys[bound_keys_count].key_sym = key_sym;
-    bound_keys[bound_keys_count].key_code = key_code;
-    bound_keys[bound_keys_count].modifiers = modifiers;
-    bound_keys[bound_keys_count].handler = handler;
-    ++bound_keys_count;
-}
+    sigemptyset(&mask);
+    sigaddset(&mask, sig);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
 
-static void grab_key(KeyCode key_code, unsigned int modifiers) {
-    XGrabKey(display, key_code, modifiers, window, False,
-            GrabModeSync, GrabModeSync);
-    XGrabKey(display, key_code, modifiers | LockMask, window, False,
-            GrabModeSync, GrabModeSync);
-    XGrabKey(display, key_code, modifiers | NumLockMask, window,
-            False, GrabModeSync, GrabModeSync);
-    XGrabKey(display, key_code, modifiers | LockMask | NumLockMask,
-            window, False, GrabModeSync, GrabModeSync);
-    XGrabKey(display, key_code, modifiers | ScrollLockMask, window,
-            False, GrabModeSync, GrabModeSync);
-    XGrabKey(display, key_code, modifiers | LockMask | ScrollLockMask,
-            window, False, GrabModeSync, GrabModeSync);
-    XGrabKey(display, key_code, modifiers | NumLockMask
-            | ScrollLockMask, window, False, GrabModeSync,
-            GrabModeSync);
-    XGrabKey(display, key_code, modifiers | LockMask | NumLockMask
-            | ScrollLockMask, window, False, GrabModeSync,
-            GrabModeSync);
-}
+    signals[signals_count].sig = sig;
+    signals[signals_count].handler = handler;
+    signals[signals_count].caught = FALSE;
+    ++signals_count;
 
-static void update_modifier_states() {
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = catch_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(sig, &action, NULL);
+}
 
-    char keys[32];
+static void catch_signal(int sig) {
 
-    XQueryKeymap(display, keys);
+    int i;
 
-#define XKEY_IS_PRESSED(key_code) ((keys[key_code / 8] & (1 << (key_code % 8))) != 0)
-    control_l_pressed = XKEY_IS_PRESSED(control_l_key_code);
-    control_r_pressed = XKEY_IS_PRESSED(control_r_key_code);
-    alt_l_pressed = XKEY_IS_PRESSED(alt_l_key_code);
-    alt_r_pressed = XKEY_IS_PRESSED(alt_r_key_code);
-    shift_l_pressed = XKEY_IS_PRESSED(shift_l_key_code);
-    shift_r_pressed = XKEY_IS_PRESSED(shift_r_key_code);
-#undef XKEY_IS_PRESSED
+    for (i = 0; i < signals_count; ++i) {
+        if (signals[i].sig == sig) {
+            signals[i].caught = TRUE;
+        }
+    }
 }
 
 /**
- * Calls UngrabKeyboard() to avoid being grabbed again by ourselves,
- * however if there is any currently grabbed key, a KeyRelease event
- * will be sent to target instead of to us.
+ * The current signal mask with the signals handled unblocked, for
+ * pselect() or ppoll() to wait with.
  */
-void xkey_send_key(Display *display, KeySym key_sym,
-        unsigned int modifiers) {
-
-    KeyCode key_code;
-    BOOL need_control, has_control, need_alt, has_alt, need_shift,
-            has_shift;
-
-    log_info("xkey_send_key: Sending %s%s%s%s",
-        modifiers & ControlMask ? "Ctrl + " : "",
-        modifiers & ShiftMask ? "Shift + " : "",
-        modifiers & AltMask ? "Alt + " : "",
-        XKeysymToString(key_sym));
-
-    key_code = XKeysymToKeycode(display, key_sym);
-    log_info("xkey_send_key: Sending key code=0x%x, modifiers=0x%x",
-            key_code, modifiers);
-
-    update_modifier_states();
-
-    need_control = (modifiers & ControlMask) != 0;
-    has_control = control_l_pressed || control_r_pressed;
-    need_alt = (modifiers & AltMask) != 0;
-    has_alt = alt_l_pressed || alt_r_pressed;
-    need_shift = (modifiers & ShiftMask) != 0;
-    has_shift = shift_l_pressed || shift_r_pressed;
-    log_info("xkey_send_key: Control needed=%d, left=%d, right=%d",
-            need_control, control_l_pressed, control_r_pressed);
-    log_info("xkey_send_key: Alt needed=%d, left=%d, right=%d",
-            need_alt, alt_l_pressed, alt_r_pressed);
-    log_info("xkey_send_key: Shift needed=%d, left=%d, right=%d",
-            need_shift, shift_l_pressed, shift_r_pressed);
-
-    XUngrabKeyboard(display, CurrentTime);
-
-    // TODO: Is this needed?
-    XTestGrabControl(display, True);
-
-    if (need_control && !has_control) {
-        XTestFakeKeyEvent(display, control_l_key_code, True,
-                CurrentTime);
-    } else if (!need_control && has_control) {
-        if (control_l_pressed) {
-            XTestFakeKeyEvent(display, control_l_key_code, False,
-                CurrentTime);
-        }
-        if (control_r_pressed) {
-            XTestFakeKeyEvent(display, control_r_key_code, False,
-                    CurrentTime);
-        }
-    }
-    if (need_alt && !has_alt) {
-        XTestFakeKeyEvent(display, alt_l_key_code, True, CurrentTime);
-    } else if (!need_alt && has_alt) {
-        if (alt_l_pressed) {
-            XTestFakeKeyEvent(display, alt_l_key_code, False,
-                    CurrentTime);
-        }
-        if (alt_r_pressed) {
-            XTestFakeKeyEvent(display, alt_r_key_code, False,
-                    CurrentTime);
-        }
-    }
-    if (need_shift && !has_shift) {
-        XTestFakeKeyEvent(display, shift_l_key_code, True,
-                CurrentTime);
-    } else if (!need_shift && has_shift) {
-        if (shift_l_pressed) {
-            XTestFakeKeyEvent(display, shift_l_key_code, False,
-                    CurrentTime);
-        }
-        if (shift_r_pressed) {
-            XTestFakeKeyEvent(display, shift_r_key_code, False,
-                    CurrentTime);
-        }
-    }
+void xkey_get_wait_signal_mask(sigset_t *mask) {
 
-    XTestFakeKeyEvent(display, key_code, True, CurrentTime);
-    XTestFakeKeyEvent(display, key_code, False, CurrentTime);
+    int i;
 
-    if (need_shift && !has_shift) {
-        XTestFakeKeyEvent(display, shift_l_key_code, False,
-                CurrentTime);
-    } else if (!need_shift && has_shift) {
-        if (shift_r_pressed) {
-            XTestFakeKeyEvent(display, shift_r_key_code, True,
-                    CurrentTime);
-        }
-        if (shift_l_pressed) {
-            XTestFakeKeyEvent(display, shift_l_key_code, True,
-                    CurrentTime);
-        }
-    }
-    if (need_alt && !has_alt) {
-        XTestFakeKeyEvent(display, alt_l_key_code, False,
-                CurrentTime);
-    } else if (!need_alt && has_alt) {
-        if (alt_r_pressed) {
-            XTestFakeKeyEvent(display, alt_r_key_code, True,
-                    CurrentTime);
-        }
-        if (alt_l_pressed) {
-            XTestFakeKeyEvent(display, alt_l_key_code, True,
-                    CurrentTime);
-        }
-    }
-    if (need_control && !has_control) {
-        XTestFakeKeyEvent(display, control_l_key_code, False,
-                CurrentTime);
-    } else if (!need_control && has_control) {
-        if (control_r_pressed) {
-            XTestFakeKeyEvent(display, control_r_key_code, True,
-                    CurrentTime);
-        }
-        if (control_l_pressed) {
-            XTestFakeKeyEvent(display, control_l_key_code, True,
-                CurrentTime);
-        }
+    sigprocmask(SIG_BLOCK, NULL, mask);
+    for (i = 0; i < signals_count; ++i) {
+        sigdelset(mask, signals[i].sig);
     }
-
-    XTestGrabControl(display, False);
 }
 
-void xkey_loop() {
+/**
+ * Calls the handlers of the signals caught since the last call, or
+ * pending while blocked.
+ */
+void xkey_dispatch_signals() {
 
-    XEvent event;
-    XKeyEvent *key_event;
-    unsigned int modifiers;
-    BOOL handled;
+    sigset_t mask, old_mask;
     int i;
 
-    while (TRUE) {
-
-        XNextEvent(display, &event);
-        if (!(event.type == KeyPress || event.type == KeyRelease)) {
-            continue;
-        }
+    // Delivers the pending signals before returning.
+    xkey_get_wait_signal_mask(&mask);
+    sigprocmask(SIG_SETMASK, &mask, &old_mask);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
 
-        key_event = &event.xkey;
-        modifiers = XKEY_NORMALIZE_MODIFIERS(key_event->state);
-        log_info("xkey_loop: Processing key code=0x%x, modifiers=0x%x, press=%d",
-                key_event->keycode, modifiers,
-                key_event->type == KeyPress);
-
-        handled = FALSE;
-        for (i = 0; i < bound_keys_count; ++i) {
-            if (key_event->keycode == bound_keys[i].key_code
-                    && modifiers == bound_keys[i].modifiers) {
-                if (bound_keys[i].handler(key_event,
-                        bound_keys[i].key_sym,
-                        bound_keys[i].modifiers)) {
-                    log_info("xkey_loop: Syncing");
-                    XAllowEvents(display, SyncKeyboard, CurrentTime);
-                } else {
-                    log_info("xkey_loop: Replaying");
-                    XAllowEvents(display, ReplayKeyboard,
-                            CurrentTime);
-                    XFlush(display);
-                }
-                handled = TRUE;
-            }
-        }
-        if (!handled) {
-            log_warn("xkey_loop: Unhandled, replaying: key code=0x%x, modifiers=0x%x, press=%d",
-                    key_event->keycode, modifiers,
-                    key_event->type == KeyPress);
-            XAllowEvents(display, ReplayKeyboard,
-                    CurrentTime);
-            XFlush(display);
+    for (i = 0; i < signals_count; ++i) {
+        if (signals[i].caught) {
+            signals[i].caught = FALSE;
+            signals[i].handler(signals[i].sig);
         }
     }
 }
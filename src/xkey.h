@@ -6,6 +6,8 @@
 #ifndef _XKEY_H_
 #define _XKEY_H_
 
+#include <signal.h>
+
 #include <X11/keysym.h>
 #include <X11/Xlib.h>
 
@@ -15,19 +17,66 @@ extern unsigned int NumLockMask;
 extern unsigned int ScrollLockMask;
 extern unsigned int AltMask;
 
-typedef BOOL (*xkey_handler_t)(XKeyEvent *event, KeySym key_sym,
-        unsigned int modifiers);
+typedef BOOL (*xkey_handler_t)(KeySym key_sym, unsigned int modifiers,
+        BOOL press);
+
+typedef void (*xkey_signal_handler_t)(int sig);
+
+/**
+ * Grabs keys, injects keys and delivers key events to handlers. A
+ * backend sets the modifier masks above on initialize.
+ */
+typedef struct {
+    char *name;
+    void (*select_device)(char *device_name);
+    void (*initialize)();
+    void (*finalize)();
+    // Returns FALSE if the key is already bound.
+    BOOL (*bind_key)(char *device_name, KeySym key_sym,
+            unsigned int modifiers, xkey_handler_t handler);
+    void (*unbind_key)(KeySym key_sym, unsigned int modifiers,
+            xkey_handler_t handler);
+    void (*send_key)(KeySym key_sym, unsigned int modifiers);
+    void (*pass_through)(unsigned int count);
+    void (*loop)();
+    void (*process_pending)();
+    void (*send_text)(char *text);
+} xkey_backend_t;
+
+void xkey_use_backend(xkey_backend_t *backend);
+
+void xkey_select_device(char *device_name);
 
 void xkey_initialize();
 
 void xkey_finalize();
 
-void xkey_bind_key(KeySym key_sym, unsigned int modifiers,
+BOOL xkey_bind_key(KeySym key_sym, unsigned int modifiers,
         xkey_handler_t handler);
 
-void xkey_send_key(Display *display, KeySym key_sym,
-        unsigned int modifiers);
+BOOL xkey_bind_device_key(char *device_name, KeySym key_sym,
+        unsigned int modifiers, xkey_handler_t handler);
+
+void xkey_unbind_key(KeySym key_sym, unsigned int modifiers,
+        xkey_handler_t handler);
+
+void xkey_pass_through(unsigned int count);
+
+void xkey_send_key(KeySym key_sym, unsigned int modifiers);
+
+void xkey_send_text(char *text);
+
+KeySym xkey_next_text_key_sym(char **text);
 
 void xkey_loop();
 
+void xkey_process_pending();
+
+void xkey_handle_signal(int sig, xkey_signal_handler_t handler);
+
+// For backends, waiting for events and handling deferred signals.
+void xkey_get_wait_signal_mask(sigset_t *mask);
+
+void xkey_dispatch_signals();
+
 #endif /* _XKEY_H_ */
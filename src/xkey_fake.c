@@ -0,0 +1,204 @@
+/**
+ * @file xkey_fake.c
+ * @author Zhang Hai
+ */
+
+#include "xkey_fake.h"
+
+#include "log.h"
+
+#define XKEY_BOUND_KEYS_MAX 256
+
+#define XKEY_NORMALIZE_MODIFIERS(modifiers) (modifiers & ~(LockMask | NumLockMask | ScrollLockMask))
+
+static void select_device(char *device_name);
+static void initialize();
+static void finalize();
+static BOOL bind_key(char *device_name, KeySym key_sym,
+        unsigned int modifiers, xkey_handler_t handler);
+static void unbind_key(KeySym key_sym, unsigned int modifiers,
+        xkey_handler_t handler);
+static int find_grab(KeySym key_sym, unsigned int modifiers);
+static void send_key(KeySym key_sym, unsigned int modifiers);
+static void pass_through(unsigned int count);
+static void loop();
+static void process_pending();
+static void send_text(char *text);
+
+xkey_backend_t xkey_fake_backend = {
+        "fake",
+        select_device,
+        initialize,
+        finalize,
+        bind_key,
+        unbind_key,
+        send_key,
+        pass_through,
+        loop,
+        process_pending,
+        send_text
+};
+
+static xkey_fake_key_t grabs[XKEY_BOUND_KEYS_MAX];
+static xkey_handler_t handlers[XKEY_BOUND_KEYS_MAX];
+static unsigned int grabs_count = 0;
+
+static xkey_fake_key_t sent_keys[XKEY_FAKE_SENT_KEYS_MAX];
+// Keeps counting once sent_keys is full.
+static unsigned long sent_keys_total = 0;
+
+static unsigned int pass_through_count = 0;
+
+/**
+ * Devices are not simulated, every binding applies to every key event.
+ */
+static void select_device(char *device_name) {}
+
+static void initialize() {
+    NumLockMask = Mod2Mask;
+    ScrollLockMask = 0;
+    AltMask = Mod1Mask;
+    grabs_count = 0;
+    sent_keys_total = 0;
+    pass_through_count = 0;
+}
+
+static void finalize() {
+    grabs_count = 0;
+}
+
+static BOOL bind_key(char *device_name, KeySym key_sym,
+        unsigned int modifiers, xkey_handler_t handler) {
+
+    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+
+    if (find_grab(key_sym, modifiers) != -1) {
+        log_warn("bind_key: Already bound, ignoring key sym=0x%lx, modifiers=0x%x",
+                key_sym, modifiers);
+        return FALSE;
+    }
+    if (grabs_count == XKEY_BOUND_KEYS_MAX) {
+        log_warn("bind_key: Too many keys, ignoring key sym=0x%lx",
+                key_sym);
+        return FALSE;
+    }
+    grabs[grabs_count].key_sym = key_sym;
+    grabs[grabs_count].modifiers = modifiers;
+    handlers[grabs_count] = handler;
+    ++grabs_count;
+    return TRUE;
+}
+
+static void unbind_key(KeySym key_sym, unsigned int modifiers,
+        xkey_handler_t handler) {
+
+    int i = find_grab(key_sym, XKEY_NORMALIZE_MODIFIERS(modifiers));
+
+    if (i == -1 || handlers[i] != handler) {
+        return;
+    }
+    --grabs_count;
+    grabs[i] = grabs[grabs_count];
+    handlers[i] = handlers[grabs_count];
+}
+
+/**
+ * Returns the index of the grab, or -1 if the key is not bound.
+ */
+static int find_grab(KeySym key_sym, unsigned int modifiers) {
+
+    int i;
+
+    for (i = 0; i < grabs_count; ++i) {
+        if (grabs[i].key_sym == key_sym
+                && grabs[i].modifiers == modifiers) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void send_key(KeySym key_sym, unsigned int modifiers) {
+    if (sent_keys_total < XKEY_FAKE_SENT_KEYS_MAX) {
+        sent_keys[sent_keys_total].key_sym = key_sym;
+        sent_keys[sent_keys_total].modifiers = modifiers;
+    }
+    ++sent_keys_total;
+}
+
+static void pass_through(unsigned int count) {
+    pass_through_count += count;
+}
+
+/**
+ * Returns at once, key events come from xkey_fake_handle_key().
+ */
+static void loop() {}
+
+/**
+ * Only signals are ever pending, see loop().
+ */
+static void process_pending() {
+    xkey_dispatch_signals();
+}
+
+/**
+ * Records each character as a key sent without modifiers.
+ */
+static void send_text(char *text) {
+
+    KeySym key_sym;
+
+    while (*text != '\0') {
+        key_sym = xkey_next_text_key_sym(&text);
+        if (key_sym != NoSymbol) {
+            send_key(key_sym, 0);
+        }
+    }
+}
+
+/**
+ * Delivers a key event the way the Xlib backend does, and returns what
+ * became of it as one of XKEY_FAKE_*.
+ */
+int xkey_fake_handle_key(KeySym key_sym, unsigned int modifiers,
+        BOOL press) {
+
+    int i;
+    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+
+    i = find_grab(key_sym, modifiers);
+    if (i == -1) {
+        return XKEY_FAKE_UNHANDLED;
+    } else if (press && pass_through_count > 0) {
+        --pass_through_count;
+        return XKEY_FAKE_PASS_THROUGH;
+    } else if (handlers[i](key_sym, modifiers, press)) {
+        return XKEY_FAKE_SYNC;
+    } else {
+        return XKEY_FAKE_REPLAY;
+    }
+}
+
+xkey_fake_key_t *xkey_fake_get_grabs(unsigned int *count) {
+    *count = grabs_count;
+    return grabs;
+}
+
+/**
+ * Gets the first XKEY_FAKE_SENT_KEYS_MAX keys sent at most, see also
+ * xkey_fake_get_sent_keys_total().
+ */
+xkey_fake_key_t *xkey_fake_get_sent_keys(unsigned int *count) {
+    *count = sent_keys_total < XKEY_FAKE_SENT_KEYS_MAX
+            ? sent_keys_total : XKEY_FAKE_SENT_KEYS_MAX;
+    return sent_keys;
+}
+
+unsigned long xkey_fake_get_sent_keys_total() {
+    return sent_keys_total;
+}
+
+void xkey_fake_clear_sent_keys() {
+    sent_keys_total = 0;
+}
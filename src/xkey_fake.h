@@ -0,0 +1,40 @@
+/**
+ * @file xkey_fake.h
+ * @author Zhang Hai
+ */
+
+#ifndef _XKEY_FAKE_H_
+#define _XKEY_FAKE_H_
+
+#include "xkey.h"
+
+#define XKEY_FAKE_SENT_KEYS_MAX 1024
+
+#define XKEY_FAKE_UNHANDLED 0
+#define XKEY_FAKE_SYNC 1
+#define XKEY_FAKE_REPLAY 2
+#define XKEY_FAKE_PASS_THROUGH 3
+
+typedef struct {
+    KeySym key_sym;
+    unsigned int modifiers;
+} xkey_fake_key_t;
+
+/**
+ * Runs in process without an X server: records grabs and injected
+ * keys, and takes key events from xkey_fake_handle_key().
+ */
+extern xkey_backend_t xkey_fake_backend;
+
+int xkey_fake_handle_key(KeySym key_sym, unsigned int modifiers,
+        BOOL press);
+
+xkey_fake_key_t *xkey_fake_get_grabs(unsigned int *count);
+
+xkey_fake_key_t *xkey_fake_get_sent_keys(unsigned int *count);
+
+unsigned long xkey_fake_get_sent_keys_total();
+
+void xkey_fake_clear_sent_keys();
+
+#endif /* _XKEY_FAKE_H_ */
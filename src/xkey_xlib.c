@@ -0,0 +1,1835 @@
+/**
+ * @file xkey_xlib.c
+ * @author Zhang Hai
+ */
+
+#include "xkey_xlib.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/select.h>
+
+#include <X11/extensions/XInput2.h>
+#include <X11/extensions/XTest.h>
+#include <X11/XKBlib.h>
+
+#include "log.h"
+#include "recorder.h"
+#include "xstats.h"
+
+#define XKEY_BOUND_KEYS_MAX 256
+#define XKEY_DEVICES_MAX 64
+#define XKEY_SELECTED_DEVICES_MAX 16
+#define XKEY_KEY_CODES_MAX 256
+
+#define XKEY_NORMALIZE_MODIFIERS(modifiers) (modifiers & ~(LockMask | NumLockMask | ScrollLockMask))
+
+static void select_device(char *device_name);
+static void initialize();
+static void finalize();
+static BOOL bind_key(char *device_name, KeySym key_sym,
+        unsigned int modifiers, xkey_handler_t handler);
+static void unbind_key(KeySym key_sym, unsigned int modifiers,
+        xkey_handler_t handler);
+static void send_key(KeySym key_sym, unsigned int modifiers);
+static void pass_through(unsigned int count);
+static void loop();
+static void process_pending();
+static void handle_event(XEvent *event);
+static void send_text(char *text);
+static void initialize_modifier_masks();
+static void initialize_modifier_states();
+static void initialize_xi2();
+static void initialize_xkb();
+static void initialize_devices();
+static BOOL add_device(XIDeviceInfo *device_info);
+static void remove_device(int device_id);
+static BOOL has_device(char *device_name);
+static void select_events(BOOL raw);
+static void grab_bound_key(int index);
+static void grab_device_bound_keys(int device_id);
+static void grab_key(KeyCode key_code, unsigned int modifiers);
+static void ungrab_bound_key(int index);
+static void ungrab_key(KeyCode key_code, unsigned int modifiers);
+static void grab_device_key(int device_id, KeyCode key_code,
+        unsigned int modifiers);
+static void ungrab_device_key(int device_id, KeyCode key_code,
+        unsigned int modifiers);
+static int find_bound_key(KeyCode key_code, unsigned int modifiers,
+        int device_id);
+static BOOL is_key_bound(KeyCode key_code, unsigned int modifiers,
+        char *device_name);
+static BOOL is_bound_on_device(int index, int device_id);
+static BOOL is_grabbed_device(int device_id);
+static BOOL is_lifted_device(int device_id);
+static void lift_grabs();
+static void restore_grabs();
+static void count_pass_through();
+static void update_modifier_states();
+static int find_pressed_modifier_key_codes(KeyCode *key_codes);
+static void fake_key_event(Display *display, KeyCode key_code,
+        Bool press);
+static int handle_error(Display *display, XErrorEvent *error_event);
+static int handle_io_error(Display *display);
+static BOOL translate_device_event(XEvent *event, XKeyEvent *key_event);
+static void handle_hierarchy_event(XIHierarchyEvent *hierarchy_event);
+static void handle_raw_event(XIRawEvent *raw_event);
+static void allow_events(BOOL replay);
+static void ungrab_keyboard();
+static BOOL find_key_code(KeySym *key_syms, int min_key_code,
+        int key_codes_count, int key_syms_per_key_code, KeySym key_sym,
+        KeyCode *key_code, BOOL *shift);
+static void update_spare_key_codes(KeySym *key_syms, int min_key_code,
+        int key_codes_count, int key_syms_per_key_code);
+static char *bind_spare_key_syms(char *text, KeySym *key_syms,
+        int min_key_code, int key_codes_count, int key_syms_per_key_code,
+        BOOL spare_only);
+static int find_spare_key_code(KeySym key_sym);
+static void change_spare_key_syms(int key_syms_per_key_code);
+static void restore_spare_key_syms();
+static void log_key_stats();
+
+xkey_backend_t xkey_xlib_backend = {
+        "xlib",
+        select_device,
+        initialize,
+        finalize,
+        bind_key,
+        unbind_key,
+        send_key,
+        pass_through,
+        loop,
+        process_pending,
+        send_text
+};
+
+static Display *display;
+static Window window;
+
+static KeyCode control_l_key_code;
+static KeyCode control_r_key_code;
+static KeyCode alt_l_key_code;
+static KeyCode alt_r_key_code;
+static KeyCode shift_l_key_code;
+static KeyCode shift_r_key_code;
+static BOOL control_l_pressed;
+static BOOL control_r_pressed;
+static BOOL alt_l_pressed;
+static BOOL alt_r_pressed;
+static BOOL shift_l_pressed;
+static BOOL shift_r_pressed;
+
+static struct {
+    KeySym key_sym;
+    KeyCode key_code;
+    unsigned int modifiers;
+    // Every slave keyboard with this name, NULL for every selected one.
+    char *device_name;
+    xkey_handler_t handler;
+    unsigned long handled_count;
+    xstats_t stats_total;
+    xstats_t stats_max;
+    // ULONG_MAX for the default budget.
+    unsigned long round_trip_budget;
+    BOOL round_trip_budget_exceeded;
+} bound_keys[XKEY_BOUND_KEYS_MAX];
+static unsigned int bound_keys_count = 0;
+
+static BOOL xi2_enabled = FALSE;
+static int xi2_opcode;
+
+static BOOL xkb_enabled = FALSE;
+static int xkb_event_base;
+// Modifiers of the core keyboard, followed while our grabs are lifted.
+static unsigned int xkb_modifiers;
+
+static struct {
+    int id;
+    char *name;
+    BOOL selected;
+} devices[XKEY_DEVICES_MAX];
+static unsigned int devices_count = 0;
+
+static char *selected_device_names[XKEY_SELECTED_DEVICES_MAX];
+static unsigned int selected_device_names_count = 0;
+
+// The slave keyboard whose grab delivered the event being handled.
+static int event_device_id = XIAllDevices;
+// The slave keyboard whose passive grab is active, if any.
+static int grabbed_device_id = XIAllDevices;
+
+// Bound key presses left to pass through untouched.
+static unsigned int pass_through_count = 0;
+// Whether our passive grabs are lifted for passing keys through, and
+// on which slave keyboard, XIAllDevices for every one.
+static BOOL grabs_lifted = FALSE;
+static int lifted_device_id = XIAllDevices;
+
+// Key codes with no key sym in the layout, and the key syms send_text()
+// left them bound to. Found on the first call.
+static KeyCode spare_key_codes[XKEY_KEY_CODES_MAX];
+static KeySym spare_key_syms[XKEY_KEY_CODES_MAX];
+// The key syms of the spare key codes in the server mapping.
+static KeySym mapped_spare_key_syms[XKEY_KEY_CODES_MAX];
+static int spare_key_codes_count = -1;
+
+static unsigned long round_trip_budget = ULONG_MAX;
+static BOOL round_trip_budget_exceeded = FALSE;
+
+/**
+ * Restricts the keyboards grabbed by xkey_bind_key() to the slave
+ * devices with the given names; every slave keyboard is grabbed if
+ * none is selected. Must be called before initialize().
+ */
+static void select_device(char *device_name) {
+
+    if (selected_device_names_count == XKEY_SELECTED_DEVICES_MAX) {
+        log_warn("select_device: Too many devices, ignoring %s",
+                device_name);
+        return;
+    }
+    selected_device_names[selected_device_names_count] = device_name;
+    ++selected_device_names_count;
+}
+
+static void initialize() {
+
+    display= XOpenDisplay(NULL);
+    if (display == NULL) {
+        log_error("initialize: XOpenDisplay returned null");
+        exit(EXIT_FAILURE);
+    }
+    window = DefaultRootWindow(display);
+    XSetErrorHandler(handle_error);
+    XSetIOErrorHandler(handle_io_error);
+    xstats_initialize(display);
+
+    initialize_modifier_masks();
+
+    initialize_modifier_states();
+
+    initialize_xi2();
+
+    initialize_xkb();
+
+    recorder_watch_pass_through(&pass_through_count);
+}
+
+/**
+ * XKB state notifications give the modifiers for keys followed through
+ * raw events, which carry none. Keys are never passed through by
+ * lifting grabs without it, and send_text() ignores the keyboard group
+ * and Caps Lock.
+ */
+static void initialize_xkb() {
+
+    int opcode, error, major = XkbMajorVersion, minor = XkbMinorVersion;
+
+    if (!XkbQueryExtension(display, &opcode, &xkb_event_base, &error,
+            &major, &minor)) {
+        log_warn("initialize_xkb: XKB unavailable, replaying keys passed through");
+        return;
+    }
+    xkb_enabled = TRUE;
+}
+
+static void initialize_modifier_masks() {
+
+    static unsigned int mask_table[8] = {
+            ShiftMask, LockMask, ControlMask, Mod1Mask, Mod2Mask,
+            Mod3Mask, Mod4Mask, Mod5Mask
+    };
+
+    XModifierKeymap *modifier_keymap;
+    KeyCode num_lock_code, scroll_lock_code, alt_l_code;
+    int i, key_count;
+
+    num_lock_code = XKeysymToKeycode(display, XK_Num_Lock);
+    scroll_lock_code = XKeysymToKeycode(display, XK_Scroll_Lock);
+    alt_l_code = XKeysymToKeycode(display, XK_Alt_L);
+
+    modifier_keymap = XGetModifierMapping(display);
+    if (modifier_keymap == NULL) {
+        // Handle critical error.
+    }
+
+    key_count = 8 * modifier_keymap->max_keypermod;
+    for (i = 0; i < key_count; ++i) {
+        if (modifier_keymap->modifiermap[i] == num_lock_code) {
+            NumLockMask = mask_table[i / modifier_keymap->max_keypermod];
+        } else if (modifier_keymap->modifiermap[i] == scroll_lock_code) {
+            ScrollLockMask = mask_table[i / modifier_keymap->max_keypermod];
+        } else if (modifier_keymap->modifiermap[i] == alt_l_code) {
+            AltMask = mask_table[i / modifier_keymap->max_keypermod];
+        }
+    }
+
+    XFreeModifiermap(modifier_keymap);
+}
+
+static void initialize_modifier_states() {
+    control_l_key_code = XKeysymToKeycode(display, XK_Control_L);
+    control_r_key_code = XKeysymToKeycode(display, XK_Control_R);
+    alt_l_key_code = XKeysymToKeycode(display, XK_Alt_L);
+    alt_r_key_code = XKeysymToKeycode(display, XK_Alt_R);
+    shift_l_key_code = XKeysymToKeycode(display, XK_Shift_L);
+    shift_r_key_code = XKeysymToKeycode(display, XK_Shift_R);
+}
+
+/**
+ * Passive grabs are placed per slave device through XInput2 when the
+ * server supports it, so that a sync grab only freezes the keyboard
+ * the key came from. Falls back to core grabs otherwise.
+ */
+static void initialize_xi2() {
+
+    int event, error, major = 2, minor = 0;
+
+    if (!XQueryExtension(display, "XInputExtension", &xi2_opcode,
+            &event, &error)) {
+        log_warn("initialize_xi2: XInputExtension unavailable, using core grabs");
+    } else if (XIQueryVersion(display, &major, &minor) != Success) {
+        log_warn("initialize_xi2: XInput2 unsupported, server version=%d.%d, using core grabs",
+                major, minor);
+    } else {
+        xi2_enabled = TRUE;
+    }
+    if (!xi2_enabled) {
+        if (selected_device_names_count > 0) {
+            log_warn("initialize_xi2: Keyboards selected but XInput2 unavailable, remapping all keyboards");
+        }
+        return;
+    }
+
+    initialize_devices();
+
+    select_events(FALSE);
+}
+
+/**
+ * Hierarchy events keep track of keyboards plugged in later, raw key
+ * events follow keys passing through while our grabs are lifted.
+ */
+static void select_events(BOOL raw) {
+
+    XIEventMask event_masks[2];
+    unsigned char hierarchy_mask[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    unsigned char raw_mask[XIMaskLen(XI_LASTEVENT)] = { 0 };
+
+    XISetMask(hierarchy_mask, XI_HierarchyChanged);
+    event_masks[0].deviceid = XIAllDevices;
+    event_masks[0].mask_len = sizeof(hierarchy_mask);
+    event_masks[0].mask = hierarchy_mask;
+
+    if (raw) {
+        XISetMask(raw_mask, XI_RawKeyPress);
+    }
+    event_masks[1].deviceid = XIAllMasterDevices;
+    event_masks[1].mask_len = sizeof(raw_mask);
+    event_masks[1].mask = raw_mask;
+
+    XISelectEvents(display, window, event_masks, 2);
+}
+
+static void initialize_devices() {
+
+    XIDeviceInfo *device_infos;
+    int i, device_infos_count;
+
+    device_infos = XIQueryDevice(display, XIAllDevices,
+            &device_infos_count);
+    for (i = 0; i < device_infos_count; ++i) {
+        add_device(&device_infos[i]);
+    }
+    XIFreeDeviceInfo(device_infos);
+
+    for (i = 0; i < selected_device_names_count; ++i) {
+        if (!has_device(selected_device_names[i])) {
+            log_warn("initialize_devices: No such keyboard: %s",
+                    selected_device_names[i]);
+        }
+    }
+}
+
+/**
+ * Returns whether the device was added as a keyboard, selected or not.
+ */
+static BOOL add_device(XIDeviceInfo *device_info) {
+
+    int i;
+    BOOL selected;
+
+    if (device_info->use != XISlaveKeyboard) {
+        return FALSE;
+    }
+
+    selected = selected_device_names_count == 0;
+    for (i = 0; i < selected_device_names_count; ++i) {
+        if (strcmp(device_info->name, selected_device_names[i]) == 0) {
+            selected = TRUE;
+            break;
+        }
+    }
+    // Our own XTest events come from these devices, only grab one
+    // selected by name, e.g. that of another master driven by a test.
+    if (strstr(device_info->name, "XTEST") != NULL
+            && (!selected || selected_device_names_count == 0)) {
+        return FALSE;
+    }
+    if (devices_count == XKEY_DEVICES_MAX) {
+        log_warn("add_device: Too many devices, ignoring %s",
+                device_info->name);
+        return FALSE;
+    }
+
+    devices[devices_count].id = device_info->deviceid;
+    devices[devices_count].name = strdup(device_info->name);
+    devices[devices_count].selected = selected;
+    ++devices_count;
+    log_info("add_device: Keyboard id=%d, name=%s, selected=%d",
+            device_info->deviceid, device_info->name, selected);
+
+    return TRUE;
+}
+
+static void remove_device(int device_id) {
+
+    int i;
+
+    for (i = 0; i < devices_count; ++i) {
+        if (devices[i].id == device_id) {
+            log_info("remove_device: Keyboard id=%d, name=%s",
+                    device_id, devices[i].name);
+            if (event_device_id == device_id) {
+                event_device_id = XIAllDevices;
+            }
+            if (grabbed_device_id == device_id) {
+                grabbed_device_id = XIAllDevices;
+            }
+            free(devices[i].name);
+            --devices_count;
+            devices[i] = devices[devices_count];
+            return;
+        }
+    }
+}
+
+static BOOL has_device(char *device_name) {
+
+    int i;
+
+    for (i = 0; i < devices_count; ++i) {
+        if (strcmp(devices[i].name, device_name) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void finalize() {
+
+    XIGrabModifiers any_modifier = { XIAnyModifier, 0 };
+    int i;
+
+    log_key_stats();
+
+    restore_spare_key_syms();
+
+    if (xi2_enabled) {
+        for (i = 0; i < devices_count; ++i) {
+            XIUngrabKeycode(display, devices[i].id, XIAnyKeycode,
+                    window, 1, &any_modifier);
+        }
+    } else {
+        XUngrabKey(display, AnyKey, AnyModifier, window);
+    }
+    ungrab_keyboard();
+    // The following line causes application to hang, since we are
+    // exiting we just ignore it.
+    //XCloseDisplay(display);
+}
+
+/**
+ * Binds the key on the slave keyboards with the given name only, or on
+ * every selected keyboard if device_name is NULL. Keyboards are matched
+ * by name, so the binding follows them when plugged in again. The
+ * restriction is ignored when XInput2 is unavailable.
+ *
+ * Returns FALSE if the key is already bound on any of the keyboards,
+ * since only one handler can be given each key event.
+ */
+static BOOL bind_key(char *device_name, KeySym key_sym,
+        unsigned int modifiers, xkey_handler_t handler) {
+
+    KeyCode key_code = XKeysymToKeycode(display, key_sym);
+    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+
+    if (device_name != NULL) {
+        if (!xi2_enabled) {
+            log_warn("bind_key: XInput2 unavailable, binding on all keyboards: %s",
+                    device_name);
+            device_name = NULL;
+        } else if (!has_device(device_name)) {
+            log_warn("bind_key: No such keyboard yet, grabbing once plugged in: %s",
+                    device_name);
+        }
+    }
+    if (is_key_bound(key_code, modifiers, device_name)) {
+        log_warn("bind_key: Already bound, ignoring key sym=0x%lx, modifiers=0x%x",
+                key_sym, modifiers);
+        return FALSE;
+    }
+    if (bound_keys_count == XKEY_BOUND_KEYS_MAX) {
+        log_warn("bind_key: Too many keys, ignoring key sym=0x%lx",
+                key_sym);
+        return FALSE;
+    }
+
+    bound_keys[bound_keys_count].key_sym = key_sym;
+    bound_keys[bound_keys_count].key_code = key_code;
+    bound_keys[bound_keys_count].modifiers = modifiers;
+    bound_keys[bound_keys_count].device_name = device_name != NULL
+            ? strdup(device_name) : NULL;
+    bound_keys[bound_keys_count].handler = handler;
+    bound_keys[bound_keys_count].handled_count = 0;
+    memset(&bound_keys[bound_keys_count].stats_total, 0,
+            sizeof(xstats_t));
+    memset(&bound_keys[bound_keys_count].stats_max, 0, sizeof(xstats_t));
+    bound_keys[bound_keys_count].round_trip_budget = ULONG_MAX;
+    bound_keys[bound_keys_count].round_trip_budget_exceeded = FALSE;
+    ++bound_keys_count;
+
+    grab_bound_key(bound_keys_count - 1);
+    return TRUE;
+}
+
+/**
+ * Removes the bindings of the key to the handler, on whichever
+ * keyboards they were made.
+ */
+static void unbind_key(KeySym key_sym, unsigned int modifiers,
+        xkey_handler_t handler) {
+
+    int i;
+    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+
+    for (i = 0; i < bound_keys_count; ) {
+        if (bound_keys[i].key_sym != key_sym
+                || bound_keys[i].modifiers != modifiers
+                || bound_keys[i].handler != handler) {
+            ++i;
+            continue;
+        }
+        log_info("unbind_key: Key sym=0x%lx, modifiers=0x%x, device name=%s",
+                key_sym, modifiers, bound_keys[i].device_name != NULL
+                ? bound_keys[i].device_name : "(all)");
+        ungrab_bound_key(i);
+        free(bound_keys[i].device_name);
+        --bound_keys_count;
+        bound_keys[i] = bound_keys[bound_keys_count];
+    }
+}
+
+/**
+ * Lets the next count presses of bound keys reach the focused window
+ * untouched.
+ *
+ * With XInput2 and XKB our grabs on the keyboard of the event being
+ * handled are lifted meanwhile, and the presses are followed through
+ * raw events which never freeze the keyboard. Otherwise, and on other
+ * keyboards, each of them is grabbed and replayed.
+ */
+static void pass_through(unsigned int count) {
+
+    pass_through_count += count;
+    log_info("pass_through: Count=%u", pass_through_count);
+
+    if (xi2_enabled && xkb_enabled && pass_through_count > 0
+            && !grabs_lifted) {
+        lift_grabs();
+    }
+}
+
+/**
+ * Warns whenever handling a bound key takes more round trips than
+ * max_round_trips, for bindings without a budget of their own. See
+ * also xkey_xlib_is_within_round_trip_budget().
+ */
+void xkey_xlib_set_round_trip_budget(unsigned long max_round_trips) {
+    round_trip_budget = max_round_trips;
+}
+
+/**
+ * Sets the budget of the bound key on every keyboard, ULONG_MAX
+ * reverts to the default one. Returns FALSE if the key is not bound.
+ */
+BOOL xkey_xlib_set_key_round_trip_budget(KeySym key_sym,
+        unsigned int modifiers, unsigned long max_round_trips) {
+
+    int i;
+    BOOL found = FALSE;
+    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].key_sym == key_sym
+                && bound_keys[i].modifiers == modifiers) {
+            bound_keys[i].round_trip_budget = max_round_trips;
+            found = TRUE;
+        }
+    }
+    return found;
+}
+
+/**
+ * Returns whether every bound key stayed within its budget.
+ */
+BOOL xkey_xlib_is_within_round_trip_budget() {
+    return !round_trip_budget_exceeded;
+}
+
+/**
+ * Returns whether the bound key stayed within its budget on every
+ * keyboard.
+ */
+BOOL xkey_xlib_is_key_within_round_trip_budget(KeySym key_sym,
+        unsigned int modifiers) {
+
+    int i;
+    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].key_sym == key_sym
+                && bound_keys[i].modifiers == modifiers
+                && bound_keys[i].round_trip_budget_exceeded) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Gets the X protocol traffic of the worst single event handled for
+ * the bound key, returns FALSE if the key is not bound.
+ */
+BOOL xkey_xlib_get_key_stats(KeySym key_sym, unsigned int modifiers,
+        xstats_t *max_stats) {
+
+    int i;
+    modifiers = XKEY_NORMALIZE_MODIFIERS(modifiers);
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].key_sym == key_sym
+                && bound_keys[i].modifiers == modifiers) {
+            *max_stats = bound_keys[i].stats_max;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Keyboards whose grabs are lifted are left to restore_grabs().
+ */
+static void grab_bound_key(int index) {
+
+    int i;
+
+    if (!xi2_enabled) {
+        grab_key(bound_keys[index].key_code, bound_keys[index].modifiers);
+        return;
+    }
+    for (i = 0; i < devices_count; ++i) {
+        if (is_bound_on_device(index, devices[i].id)
+                && !is_lifted_device(devices[i].id)) {
+            grab_device_key(devices[i].id, bound_keys[index].key_code,
+                    bound_keys[index].modifiers);
+        }
+    }
+}
+
+/**
+ * Grabs every key bound on the keyboard, one round trip each.
+ */
+static void grab_device_bound_keys(int device_id) {
+
+    int i;
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (is_bound_on_device(i, device_id)) {
+            grab_device_key(device_id, bound_keys[i].key_code,
+                    bound_keys[i].modifiers);
+        }
+    }
+}
+
+/**
+ * Bindings never overlap, so the grabs are not shared with another
+ * binding. Lifted grabs are restored from bound_keys, nothing to undo.
+ */
+static void ungrab_bound_key(int index) {
+
+    int i;
+
+    if (!xi2_enabled) {
+        ungrab_key(bound_keys[index].key_code,
+                bound_keys[index].modifiers);
+        return;
+    }
+    for (i = 0; i < devices_count; ++i) {
+        if (is_bound_on_device(index, devices[i].id)
+                && !is_lifted_device(devices[i].id)) {
+            ungrab_device_key(devices[i].id, bound_keys[index].key_code,
+                    bound_keys[index].modifiers);
+        }
+    }
+}
+
+static void grab_key(KeyCode key_code, unsigned int modifiers) {
+    XGrabKey(display, key_code, modifiers, window, False,
+            GrabModeSync, GrabModeSync);
+    XGrabKey(display, key_code, modifiers | LockMask, window, False,
+            GrabModeSync, GrabModeSync);
+    XGrabKey(display, key_code, modifiers | NumLockMask, window,
+            False, GrabModeSync, GrabModeSync);
+    XGrabKey(display, key_code, modifiers | LockMask | NumLockMask,
+            window, False, GrabModeSync, GrabModeSync);
+    XGrabKey(display, key_code, modifiers | ScrollLockMask, window,
+            False, GrabModeSync, GrabModeSync);
+    XGrabKey(display, key_code, modifiers | LockMask | ScrollLockMask,
+            window, False, GrabModeSync, GrabModeSync);
+    XGrabKey(display, key_code, modifiers | NumLockMask
+            | ScrollLockMask, window, False, GrabModeSync,
+            GrabModeSync);
+    XGrabKey(display, key_code, modifiers | LockMask | NumLockMask
+            | ScrollLockMask, window, False, GrabModeSync,
+            GrabModeSync);
+}
+
+static void ungrab_key(KeyCode key_code, unsigned int modifiers) {
+    XUngrabKey(display, key_code, modifiers, window);
+    XUngrabKey(display, key_code, modifiers | LockMask, window);
+    XUngrabKey(display, key_code, modifiers | NumLockMask, window);
+    XUngrabKey(display, key_code, modifiers | LockMask | NumLockMask,
+            window);
+    XUngrabKey(display, key_code, modifiers | ScrollLockMask, window);
+    XUngrabKey(display, key_code, modifiers | LockMask | ScrollLockMask,
+            window);
+    XUngrabKey(display, key_code, modifiers | NumLockMask
+            | ScrollLockMask, window);
+    XUngrabKey(display, key_code, modifiers | LockMask | NumLockMask
+            | ScrollLockMask, window);
+}
+
+/**
+ * The paired pointer is left running, only the keyboard is frozen.
+ */
+static void grab_device_key(int device_id, KeyCode key_code,
+        unsigned int modifiers) {
+
+    XIGrabModifiers grab_modifiers[8] = {
+            { modifiers, 0 },
+            { modifiers | LockMask, 0 },
+            { modifiers | NumLockMask, 0 },
+            { modifiers | LockMask | NumLockMask, 0 },
+            { modifiers | ScrollLockMask, 0 },
+            { modifiers | LockMask | ScrollLockMask, 0 },
+            { modifiers | NumLockMask | ScrollLockMask, 0 },
+            { modifiers | LockMask | NumLockMask | ScrollLockMask, 0 }
+    };
+    XIEventMask event_mask;
+    unsigned char mask[XIMaskLen(XI_LASTEVENT)] = { 0 };
+    int failed_count;
+
+    XISetMask(mask, XI_KeyPress);
+    XISetMask(mask, XI_KeyRelease);
+    event_mask.deviceid = device_id;
+    event_mask.mask_len = sizeof(mask);
+    event_mask.mask = mask;
+
+    failed_count = XIGrabKeycode(display, device_id, key_code, window,
+            XIGrabModeSync, XIGrabModeAsync, False, &event_mask, 8,
+            grab_modifiers);
+    if (failed_count != 0) {
+        log_warn("grab_device_key: %d grabs failed: device id=%d, key code=0x%x, modifiers=0x%x",
+                failed_count, device_id, key_code, modifiers);
+    }
+}
+
+static void ungrab_device_key(int device_id, KeyCode key_code,
+        unsigned int modifiers) {
+
+    XIGrabModifiers grab_modifiers[8] = {
+            { modifiers, 0 },
+            { modifiers | LockMask, 0 },
+            { modifiers | NumLockMask, 0 },
+            { modifiers | LockMask | NumLockMask, 0 },
+            { modifiers | ScrollLockMask, 0 },
+            { modifiers | LockMask | ScrollLockMask, 0 },
+            { modifiers | NumLockMask | ScrollLockMask, 0 },
+            { modifiers | LockMask | NumLockMask | ScrollLockMask, 0 }
+    };
+
+    XIUngrabKeycode(display, device_id, key_code, window, 8,
+            grab_modifiers);
+}
+
+/**
+ * Returns the index of the binding, or -1 if the key is not bound.
+ * XIAllDevices matches bindings on any device.
+ */
+static int find_bound_key(KeyCode key_code, unsigned int modifiers,
+        int device_id) {
+
+    int i;
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].key_code == key_code
+                && bound_keys[i].modifiers == modifiers
+                && is_bound_on_device(i, device_id)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Whether a binding on the keyboards with the given name, or on every
+ * selected one if NULL, would overlap one already made.
+ */
+static BOOL is_key_bound(KeyCode key_code, unsigned int modifiers,
+        char *device_name) {
+
+    int i;
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].key_code == key_code
+                && bound_keys[i].modifiers == modifiers
+                && (device_name == NULL || bound_keys[i].device_name == NULL
+                || strcmp(bound_keys[i].device_name, device_name) == 0)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Whether the binding applies to the keyboard, looked up by name so that
+ * every keyboard of that name matches. XIAllDevices matches any.
+ */
+static BOOL is_bound_on_device(int index, int device_id) {
+
+    int i;
+
+    if (device_id == XIAllDevices) {
+        return TRUE;
+    }
+    for (i = 0; i < devices_count; ++i) {
+        if (devices[i].id == device_id) {
+            if (bound_keys[index].device_name == NULL) {
+                return devices[i].selected;
+            }
+            return strcmp(devices[i].name,
+                    bound_keys[index].device_name) == 0;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL is_grabbed_device(int device_id) {
+
+    int i;
+
+    for (i = 0; i < devices_count; ++i) {
+        if (devices[i].id == device_id && devices[i].selected) {
+            return TRUE;
+        }
+    }
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].device_name != NULL
+                && is_bound_on_device(i, device_id)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static BOOL is_lifted_device(int device_id) {
+    return grabs_lifted && (lifted_device_id == XIAllDevices
+            || lifted_device_id == device_id);
+}
+
+/**
+ * Lifts the grabs of the keyboard of the event being handled only, the
+ * one the keys passing through most likely come from, since restoring
+ * them takes a round trip per binding and keyboard. Bound keys from
+ * other keyboards are still grabbed and replayed.
+ *
+ * The modifiers are followed through XKB state notifications from here
+ * on, which the server sends in order with the raw key events. A key
+ * pressed before the ungrab is processed still reaches us, and
+ * is replayed in handle_event().
+ */
+static void lift_grabs() {
+
+    XIGrabModifiers any_modifier = { XIAnyModifier, 0 };
+    XkbStateRec state;
+    int i;
+
+    lifted_device_id = event_device_id;
+    grabs_lifted = TRUE;
+    log_info("lift_grabs: Lifting grabs, device id=%d", lifted_device_id);
+    for (i = 0; i < devices_count; ++i) {
+        if (is_lifted_device(devices[i].id)) {
+            XIUngrabKeycode(display, devices[i].id, XIAnyKeycode, window,
+                    1, &any_modifier);
+        }
+    }
+    // Selected before getting the state so that no change is missed.
+    XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify,
+            XkbModifierStateMask, XkbModifierStateMask);
+    XkbGetState(display, XkbUseCoreKbd, &state);
+    xkb_modifiers = state.mods;
+    select_events(TRUE);
+}
+
+/**
+ * Grabs again only on the keyboards lifted. A key pressed right before
+ * the grabs are restored can still escape them.
+ */
+static void restore_grabs() {
+
+    int i;
+
+    log_info("restore_grabs: Restoring grabs, device id=%d",
+            lifted_device_id);
+    select_events(FALSE);
+    XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify,
+            XkbModifierStateMask, 0);
+    for (i = 0; i < devices_count; ++i) {
+        if (is_lifted_device(devices[i].id)) {
+            grab_device_bound_keys(devices[i].id);
+        }
+    }
+    grabs_lifted = FALSE;
+    lifted_device_id = XIAllDevices;
+}
+
+static void count_pass_through() {
+    --pass_through_count;
+    log_info("count_pass_through: Count=%u", pass_through_count);
+    if (pass_through_count == 0 && grabs_lifted) {
+        restore_grabs();
+    }
+}
+
+static void update_modifier_states() {
+
+    char keys[32];
+
+    XQueryKeymap(display, keys);
+
+#define XKEY_IS_PRESSED(key_code) ((keys[key_code / 8] & (1 << (key_code % 8))) != 0)
+    control_l_pressed = XKEY_IS_PRESSED(control_l_key_code);
+    control_r_pressed = XKEY_IS_PRESSED(control_r_key_code);
+    alt_l_pressed = XKEY_IS_PRESSED(alt_l_key_code);
+    alt_r_pressed = XKEY_IS_PRESSED(alt_r_key_code);
+    shift_l_pressed = XKEY_IS_PRESSED(shift_l_key_code);
+    shift_r_pressed = XKEY_IS_PRESSED(shift_r_key_code);
+#undef XKEY_IS_PRESSED
+}
+
+/**
+ * Finds the key codes of every modifier key held, lock keys aside
+ * since they toggle on press. Returns their count.
+ */
+static int find_pressed_modifier_key_codes(KeyCode *key_codes) {
+
+    XModifierKeymap *modifier_keymap;
+    char keys[32];
+    KeyCode key_code;
+    unsigned int mask;
+    int i, j, k, count = 0;
+
+    modifier_keymap = XGetModifierMapping(display);
+    if (modifier_keymap == NULL) {
+        log_error("find_pressed_modifier_key_codes: XGetModifierMapping returned null");
+        return 0;
+    }
+    XQueryKeymap(display, keys);
+
+#define XKEY_IS_PRESSED(key_code) ((keys[key_code / 8] & (1 << (key_code % 8))) != 0)
+    for (i = 0; i < 8; ++i) {
+        mask = 1 << i;
+        if (mask == LockMask || mask == NumLockMask
+                || mask == ScrollLockMask) {
+            continue;
+        }
+        for (j = 0; j < modifier_keymap->max_keypermod; ++j) {
+            key_code = modifier_keymap->modifiermap[
+                    i * modifier_keymap->max_keypermod + j];
+            if (key_code == 0 || !XKEY_IS_PRESSED(key_code)) {
+                continue;
+            }
+            for (k = 0; k < count; ++k) {
+                if (key_codes[k] == key_code) {
+                    break;
+                }
+            }
+            if (k == count) {
+                key_codes[count] = key_code;
+                ++count;
+            }
+        }
+    }
+#undef XKEY_IS_PRESSED
+
+    XFreeModifiermap(modifier_keymap);
+    return count;
+}
+
+static void fake_key_event(Display *display, KeyCode key_code,
+        Bool press) {
+    XTestFakeKeyEvent(display, key_code, press, CurrentTime);
+    recorder_add_key(key_code, press);
+}
+
+/**
+ * Losing the display is the usual abnormal exit, keep the recent
+ * events around for inspection.
+ */
+/**
+ * Exits like the default handler does, but leaves the recent key events
+ * behind.
+ */
+static int handle_error(Display *display, XErrorEvent *error_event) {
+
+    char text[256];
+
+    XGetErrorText(display, error_event->error_code, text, sizeof(text));
+    log_error("handle_error: %s, request=%d.%d, resource=0x%lx, serial=%lu",
+            text, error_event->request_code, error_event->minor_code,
+            error_event->resourceid, error_event->serial);
+    recorder_dump();
+    exit(EXIT_FAILURE);
+}
+
+static int handle_io_error(Display *display) {
+    log_error("handle_io_error: Connection to X server lost");
+    recorder_dump();
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Calls UngrabKeyboard() to avoid being grabbed again by ourselves,
+ * however if there is any currently grabbed key, a KeyRelease event
+ * will be sent to target instead of to us.
+ */
+static void send_key(KeySym key_sym, unsigned int modifiers) {
+
+    KeyCode key_code;
+    BOOL need_control, has_control, need_alt, has_alt, need_shift,
+            has_shift, echo_grabbed;
+
+    log_info("send_key: Sending %s%s%s%s",
+        modifiers & ControlMask ? "Ctrl + " : "",
+        modifiers & ShiftMask ? "Shift + " : "",
+        modifiers & AltMask ? "Alt + " : "",
+        XKeysymToString(key_sym));
+
+    key_code = XKeysymToKeycode(display, key_sym);
+    log_info("send_key: Sending key code=0x%x, modifiers=0x%x",
+            key_code, modifiers);
+
+    update_modifier_states();
+
+    // XTest keys come from a keyboard of their own which is never
+    // grabbed through XInput2, but core grabs would catch them.
+    echo_grabbed = !xi2_enabled && find_bound_key(key_code,
+            XKEY_NORMALIZE_MODIFIERS(modifiers), XIAllDevices) != -1;
+
+    need_control = (modifiers & ControlMask) != 0;
+    has_control = control_l_pressed || control_r_pressed;
+    need_alt = (modifiers & AltMask) != 0;
+    has_alt = alt_l_pressed || alt_r_pressed;
+    need_shift = (modifiers & ShiftMask) != 0;
+    has_shift = shift_l_pressed || shift_r_pressed;
+    log_info("send_key: Control needed=%d, left=%d, right=%d",
+            need_control, control_l_pressed, control_r_pressed);
+    log_info("send_key: Alt needed=%d, left=%d, right=%d",
+            need_alt, alt_l_pressed, alt_r_pressed);
+    log_info("send_key: Shift needed=%d, left=%d, right=%d",
+            need_shift, shift_l_pressed, shift_r_pressed);
+
+    ungrab_keyboard();
+
+    // TODO: Is this needed?
+    XTestGrabControl(display, True);
+
+    if (need_control && !has_control) {
+        fake_key_event(display, control_l_key_code, True);
+    } else if (!need_control && has_control) {
+        if (control_l_pressed) {
+            fake_key_event(display, control_l_key_code, False);
+        }
+        if (control_r_pressed) {
+            fake_key_event(display, control_r_key_code, False);
+        }
+    }
+    if (need_alt && !has_alt) {
+        fake_key_event(display, alt_l_key_code, True);
+    } else if (!need_alt && has_alt) {
+        if (alt_l_pressed) {
+            fake_key_event(display, alt_l_key_code, False);
+        }
+        if (alt_r_pressed) {
+            fake_key_event(display, alt_r_key_code, False);
+        }
+    }
+    if (need_shift && !has_shift) {
+        fake_key_event(display, shift_l_key_code, True);
+    } else if (!need_shift && has_shift) {
+        if (shift_l_pressed) {
+            fake_key_event(display, shift_l_key_code, False);
+        }
+        if (shift_r_pressed) {
+            fake_key_event(display, shift_r_key_code, False);
+        }
+    }
+
+    if (echo_grabbed) {
+        ungrab_key(key_code, XKEY_NORMALIZE_MODIFIERS(modifiers));
+    }
+    fake_key_event(display, key_code, True);
+    fake_key_event(display, key_code, False);
+    if (echo_grabbed) {
+        grab_key(key_code, XKEY_NORMALIZE_MODIFIERS(modifiers));
+    }
+
+    if (need_shift && !has_shift) {
+        fake_key_event(display, shift_l_key_code, False);
+    } else if (!need_shift && has_shift) {
+        if (shift_r_pressed) {
+            fake_key_event(display, shift_r_key_code, True);
+        }
+        if (shift_l_pressed) {
+            fake_key_event(display, shift_l_key_code, True);
+        }
+    }
+    if (need_alt && !has_alt) {
+        fake_key_event(display, alt_l_key_code, False);
+    } else if (!need_alt && has_alt) {
+        if (alt_r_pressed) {
+            fake_key_event(display, alt_r_key_code, True);
+        }
+        if (alt_l_pressed) {
+            fake_key_event(display, alt_l_key_code, True);
+        }
+    }
+    if (need_control && !has_control) {
+        fake_key_event(display, control_l_key_code, False);
+    } else if (!need_control && has_control) {
+        if (control_r_pressed) {
+            fake_key_event(display, control_r_key_code, True);
+        }
+        if (control_l_pressed) {
+            fake_key_event(display, control_l_key_code, True);
+        }
+    }
+
+    XTestGrabControl(display, False);
+}
+
+/**
+ * Signals handled through xkey_handle_signal() stay blocked between
+ * checking for events and waiting for the connection, so that none is
+ * left undispatched while we wait.
+ */
+static void loop() {
+
+    XEvent event;
+    int fd = ConnectionNumber(display);
+    fd_set fds;
+    sigset_t wait_mask;
+
+    xkey_get_wait_signal_mask(&wait_mask);
+    while (TRUE) {
+        xkey_dispatch_signals();
+        // Also flushes our requests.
+        if (XPending(display) == 0) {
+            FD_ZERO(&fds);
+            FD_SET(fd, &fds);
+            pselect(fd + 1, &fds, NULL, NULL, NULL, &wait_mask);
+            continue;
+        }
+        XNextEvent(display, &event);
+        handle_event(&event);
+    }
+}
+
+/**
+ * Handles the events caused by the requests made so far, including
+ * those of other clients, and returns. Lets a harness driving a server
+ * check the stats after each input it fakes.
+ */
+static void process_pending() {
+
+    XEvent event;
+
+    xkey_dispatch_signals();
+    XSync(display, False);
+    while (XPending(display) > 0) {
+        XNextEvent(display, &event);
+        handle_event(&event);
+        if (XPending(display) == 0) {
+            XSync(display, False);
+        }
+    }
+}
+
+static void handle_event(XEvent *event) {
+
+    XKeyEvent *key_event;
+    unsigned int modifiers;
+    BOOL handled;
+    KeySym handled_key_sym;
+    int decision, handled_index, i;
+    unsigned long budget;
+    xstats_t stats, event_stats;
+
+    if (xi2_enabled) {
+        if (!translate_device_event(event, &event->xkey)) {
+            return;
+        }
+    } else if (!(event->type == KeyPress || event->type == KeyRelease)) {
+        return;
+    }
+
+    key_event = &event->xkey;
+    modifiers = XKEY_NORMALIZE_MODIFIERS(key_event->state);
+    log_info("handle_event: Processing key code=0x%x, modifiers=0x%x, press=%d, device id=%d",
+            key_event->keycode, modifiers,
+            key_event->type == KeyPress, event_device_id);
+    recorder_begin(key_event->time, key_event->keycode, modifiers,
+            key_event->type == KeyPress, event_device_id);
+    xstats_get(&event_stats);
+
+    handled = FALSE;
+    handled_key_sym = NoSymbol;
+    decision = RECORDER_DECISION_UNHANDLED;
+    handled_index = -1;
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (key_event->keycode == bound_keys[i].key_code
+                && modifiers == bound_keys[i].modifiers
+                && is_bound_on_device(i, event_device_id)) {
+            if (key_event->type == KeyPress && pass_through_count > 0) {
+                log_info("handle_event: Passing through");
+                count_pass_through();
+                allow_events(TRUE);
+                XFlush(display);
+                decision = RECORDER_DECISION_PASS_THROUGH;
+            } else if (bound_keys[i].handler(bound_keys[i].key_sym,
+                    bound_keys[i].modifiers,
+                    key_event->type == KeyPress)) {
+                log_info("handle_event: Syncing");
+                allow_events(FALSE);
+                decision = RECORDER_DECISION_SYNC;
+            } else {
+                log_info("handle_event: Replaying");
+                allow_events(TRUE);
+                XFlush(display);
+                decision = RECORDER_DECISION_REPLAY;
+            }
+            handled = TRUE;
+            handled_key_sym = bound_keys[i].key_sym;
+            handled_index = i;
+        }
+    }
+    if (!handled) {
+        log_warn("handle_event: Unhandled, replaying: key code=0x%x, modifiers=0x%x, press=%d",
+                key_event->keycode, modifiers,
+                key_event->type == KeyPress);
+        allow_events(TRUE);
+        XFlush(display);
+    }
+    recorder_end(handled_key_sym, decision);
+    // The passive grab ends with the release of its key.
+    if (key_event->type == KeyRelease) {
+        grabbed_device_id = XIAllDevices;
+    }
+
+    xstats_get(&stats);
+    xstats_subtract(&stats, &event_stats);
+    log_info("handle_event: X requests=%lu, round trips=%lu, flushes=%lu, bytes=%lu",
+            stats.requests, stats.round_trips, stats.flushes,
+            stats.bytes);
+    if (handled_index != -1) {
+        ++bound_keys[handled_index].handled_count;
+        xstats_add(&bound_keys[handled_index].stats_total, &stats);
+        xstats_max(&bound_keys[handled_index].stats_max, &stats);
+        budget = bound_keys[handled_index].round_trip_budget;
+        if (budget == ULONG_MAX) {
+            budget = round_trip_budget;
+        }
+        if (stats.round_trips > budget) {
+            bound_keys[handled_index].round_trip_budget_exceeded = TRUE;
+            round_trip_budget_exceeded = TRUE;
+            log_warn("handle_event: Over round trip budget: key sym=0x%lx, modifiers=0x%x, round trips=%lu, budget=%lu",
+                    handled_key_sym, modifiers, stats.round_trips, budget);
+        }
+    }
+}
+
+static BOOL translate_device_event(XEvent *event, XKeyEvent *key_event) {
+
+    XGenericEventCookie *cookie = &event->xcookie;
+    XkbEvent *xkb_event = (XkbEvent *)event;
+    XIDeviceEvent *device_event;
+    XKeyEvent translated;
+
+    if (xkb_enabled && event->type == xkb_event_base) {
+        if (xkb_event->any.xkb_type == XkbStateNotify) {
+            xkb_modifiers = xkb_event->state.mods;
+        }
+        return FALSE;
+    }
+
+    if (cookie->type != GenericEvent || cookie->extension != xi2_opcode
+            || !XGetEventData(display, cookie)) {
+        return FALSE;
+    }
+
+    if (cookie->evtype == XI_HierarchyChanged) {
+        handle_hierarchy_event(cookie->data);
+        XFreeEventData(display, cookie);
+        return FALSE;
+    } else if (cookie->evtype == XI_RawKeyPress) {
+        handle_raw_event(cookie->data);
+        XFreeEventData(display, cookie);
+        return FALSE;
+    } else if (!(cookie->evtype == XI_KeyPress
+            || cookie->evtype == XI_KeyRelease)) {
+        XFreeEventData(display, cookie);
+        return FALSE;
+    }
+
+    device_event = cookie->data;
+    translated.type = cookie->evtype == XI_KeyPress ? KeyPress
+            : KeyRelease;
+    translated.serial = device_event->serial;
+    translated.send_event = device_event->send_event;
+    translated.display = device_event->display;
+    translated.window = device_event->event;
+    translated.root = device_event->root;
+    translated.subwindow = device_event->child;
+    translated.time = device_event->time;
+    translated.x = device_event->event_x;
+    translated.y = device_event->event_y;
+    translated.x_root = device_event->root_x;
+    translated.y_root = device_event->root_y;
+    translated.state = device_event->mods.effective;
+    translated.keycode = device_event->detail;
+    translated.same_screen = True;
+    event_device_id = device_event->deviceid;
+    // A press of a bound key activates our passive grab.
+    if (cookie->evtype == XI_KeyPress) {
+        grabbed_device_id = event_device_id;
+    }
+    XFreeEventData(display, cookie);
+
+    *key_event = translated;
+    return TRUE;
+}
+
+/**
+ * Grabs the keys bound on newly attached keyboards, on every selected
+ * one or on those by name.
+ */
+static void handle_hierarchy_event(XIHierarchyEvent *hierarchy_event) {
+
+    XIDeviceInfo *device_info;
+    int i, device_info_count;
+
+    for (i = 0; i < hierarchy_event->num_info; ++i) {
+        if (hierarchy_event->info[i].flags & XISlaveRemoved) {
+            remove_device(hierarchy_event->info[i].deviceid);
+        } else if (hierarchy_event->info[i].flags & XISlaveAdded) {
+            device_info = XIQueryDevice(display,
+                    hierarchy_event->info[i].deviceid,
+                    &device_info_count);
+            if (device_info == NULL) {
+                continue;
+            }
+            // Grabs lifted are restored by restore_grabs().
+            if (add_device(device_info)
+                    && !is_lifted_device(device_info->deviceid)) {
+                grab_device_bound_keys(device_info->deviceid);
+            }
+            XIFreeDeviceInfo(device_info);
+        }
+    }
+}
+
+/**
+ * Follows keys passing through while our grabs are lifted. Raw events
+ * carry no modifier state, so it is taken from the XKB state of the
+ * core keyboard.
+ */
+static void handle_raw_event(XIRawEvent *raw_event) {
+
+    KeyCode key_code = raw_event->detail;
+    unsigned int modifiers = XKEY_NORMALIZE_MODIFIERS(xkb_modifiers);
+    int index;
+
+    // Bound keys from other keyboards are still grabbed and counted in
+    // handle_event().
+    if (!is_lifted_device(raw_event->sourceid)
+            || !is_grabbed_device(raw_event->sourceid)) {
+        return;
+    }
+
+    index = find_bound_key(key_code, modifiers, raw_event->sourceid);
+    if (index == -1) {
+        return;
+    }
+    log_info("handle_raw_event: Passed through key code=0x%x, modifiers=0x%x",
+            key_code, modifiers);
+    recorder_begin(raw_event->time, key_code, modifiers, TRUE,
+            raw_event->sourceid);
+    count_pass_through();
+    recorder_end(bound_keys[index].key_sym,
+            RECORDER_DECISION_PASS_THROUGH);
+}
+
+/**
+ * Types the text as a pipelined XTest stream. Key syms missing from the
+ * layout are bound to spare key codes in batches, as many distinct ones
+ * as there are spare key codes, with a mapping change before each
+ * batch.
+ *
+ * Clients look the mapping up lazily, so it is left in place after the
+ * last batch, and the keys sent so far are synced before a spare key
+ * code is rebound. Key syms bound by earlier calls are reused, and the
+ * spare key codes are only cleared on finalize.
+ *
+ * Every modifier key held is released meanwhile, AltGr and Super
+ * included. The core mapping only tells the keys of the first group,
+ * so in any other group everything is typed through spare key codes,
+ * which have a single group. Caps Lock is unlocked meanwhile.
+ */
+static void send_text(char *text) {
+
+    int min_key_code, max_key_code, key_codes_count,
+            key_syms_per_key_code, pressed_count, i;
+    KeySym *key_syms, key_sym;
+    KeyCode key_code, pressed_key_codes[XKEY_KEY_CODES_MAX];
+    XkbStateRec state;
+    BOOL spare_only = FALSE, caps_locked = FALSE, shift, echo_grabbed;
+    char *batch_end;
+
+    XDisplayKeycodes(display, &min_key_code, &max_key_code);
+    key_codes_count = max_key_code - min_key_code + 1;
+    key_syms = XGetKeyboardMapping(display, min_key_code,
+            key_codes_count, &key_syms_per_key_code);
+    if (key_syms == NULL) {
+        log_error("send_text: XGetKeyboardMapping returned null");
+        return;
+    }
+
+    if (xkb_enabled && XkbGetState(display, XkbUseCoreKbd, &state)
+            == Success) {
+        spare_only = state.group != 0;
+        caps_locked = (state.locked_mods & LockMask) != 0;
+        log_info("send_text: Group=%d, Caps Lock=%d", state.group,
+                caps_locked);
+    }
+
+    update_spare_key_codes(key_syms, min_key_code, key_codes_count,
+            key_syms_per_key_code);
+
+    pressed_count = find_pressed_modifier_key_codes(pressed_key_codes);
+    ungrab_keyboard();
+    XTestGrabControl(display, True);
+
+    for (i = 0; i < pressed_count; ++i) {
+        fake_key_event(display, pressed_key_codes[i], False);
+    }
+    if (caps_locked) {
+        XkbLockModifiers(display, XkbUseCoreKbd, LockMask, 0);
+    }
+
+    while (*text != '\0') {
+        batch_end = bind_spare_key_syms(text, key_syms, min_key_code,
+                key_codes_count, key_syms_per_key_code, spare_only);
+        while (text != batch_end) {
+            key_sym = xkey_next_text_key_sym(&text);
+            if (key_sym == NoSymbol) {
+                continue;
+            }
+            if (spare_only || !find_key_code(key_syms, min_key_code,
+                    key_codes_count, key_syms_per_key_code, key_sym,
+                    &key_code, &shift)) {
+                i = find_spare_key_code(key_sym);
+                if (i == -1) {
+                    log_warn("send_text: No key code for key sym=0x%lx",
+                            key_sym);
+                    continue;
+                }
+                key_code = spare_key_codes[i];
+                shift = FALSE;
+            }
+            // As in send_key(), core grabs would catch bound keys.
+            echo_grabbed = !xi2_enabled && find_bound_key(key_code,
+                    shift ? ShiftMask : 0, XIAllDevices) != -1;
+            if (shift) {
+                fake_key_event(display, shift_l_key_code, True);
+            }
+            if (echo_grabbed) {
+                ungrab_key(key_code, shift ? ShiftMask : 0);
+            }
+            fake_key_event(display, key_code, True);
+            fake_key_event(display, key_code, False);
+            if (echo_grabbed) {
+                grab_key(key_code, shift ? ShiftMask : 0);
+            }
+            if (shift) {
+                fake_key_event(display, shift_l_key_code, False);
+            }
+        }
+    }
+
+    if (caps_locked) {
+        XkbLockModifiers(display, XkbUseCoreKbd, LockMask, LockMask);
+    }
+    for (i = pressed_count - 1; i >= 0; --i) {
+        fake_key_event(display, pressed_key_codes[i], True);
+    }
+
+    XTestGrabControl(display, False);
+    XFree(key_syms);
+    XFlush(display);
+}
+
+/**
+ * Finds the spare key codes on the first call, and afterwards drops
+ * those a new layout has taken. The spare key codes are then cleared
+ * in key_syms, so that they are only looked up through
+ * find_spare_key_code().
+ */
+static void update_spare_key_codes(KeySym *key_syms, int min_key_code,
+        int key_codes_count, int key_syms_per_key_code) {
+
+    KeySym *key_code_key_syms;
+    int i, j, kept_count = 0;
+
+    if (spare_key_codes_count == -1) {
+        spare_key_codes_count = 0;
+        for (i = 0; i < key_codes_count && i < XKEY_KEY_CODES_MAX; ++i) {
+            // Only key codes with no key sym at all are spare.
+            for (j = 0; j < key_syms_per_key_code; ++j) {
+                if (key_syms[i * key_syms_per_key_code + j] != NoSymbol) {
+                    break;
+                }
+            }
+            if (j == key_syms_per_key_code) {
+                spare_key_codes[spare_key_codes_count] = min_key_code + i;
+                spare_key_syms[spare_key_codes_count] = NoSymbol;
+                ++spare_key_codes_count;
+            }
+        }
+        log_info("update_spare_key_codes: Spare key codes=%d",
+                spare_key_codes_count);
+    } else {
+        for (i = 0; i < spare_key_codes_count; ++i) {
+            if (spare_key_codes[i] - min_key_code >= key_codes_count) {
+                continue;
+            }
+            key_code_key_syms = &key_syms[(spare_key_codes[i]
+                    - min_key_code) * key_syms_per_key_code];
+            if (key_code_key_syms[0] == NoSymbol) {
+                // Cleared by a new layout.
+                spare_key_syms[i] = NoSymbol;
+            } else if (key_code_key_syms[0] != spare_key_syms[i]) {
+                log_warn("update_spare_key_codes: Key code 0x%x taken by the layout",
+                        spare_key_codes[i]);
+                continue;
+            }
+            spare_key_codes[kept_count] = spare_key_codes[i];
+            spare_key_syms[kept_count] = spare_key_syms[i];
+            ++kept_count;
+        }
+        spare_key_codes_count = kept_count;
+    }
+
+    for (i = 0; i < spare_key_codes_count; ++i) {
+        mapped_spare_key_syms[i] = spare_key_syms[i];
+    }
+
+    for (i = 0; i < spare_key_codes_count; ++i) {
+        for (j = 0; j < key_syms_per_key_code; ++j) {
+            key_syms[(spare_key_codes[i] - min_key_code)
+                    * key_syms_per_key_code + j] = NoSymbol;
+        }
+    }
+}
+
+/**
+ * Binds the key syms missing from the layout, or all of them if
+ * spare_only, to spare key codes for the longest run of the text they
+ * fit, and returns the end of that run. Key syms already bound are
+ * kept, and key codes with no key sym are taken first.
+ *
+ * Rebinding a key code which had a key sym waits for the server to
+ * deliver every key sent before, which may be looked up with it.
+ */
+static char *bind_spare_key_syms(char *text, KeySym *key_syms,
+        int min_key_code, int key_codes_count, int key_syms_per_key_code,
+        BOOL spare_only) {
+
+    KeySym missing_key_syms[XKEY_KEY_CODES_MAX], key_sym;
+    BOOL kept[XKEY_KEY_CODES_MAX], rebound = FALSE, shift;
+    KeyCode key_code;
+    int missing_count = 0, i, j;
+    char *batch_end = text, *next;
+
+    if (spare_key_codes_count <= 0) {
+        return text + strlen(text);
+    }
+
+    while (*batch_end != '\0') {
+        next = batch_end;
+        key_sym = xkey_next_text_key_sym(&next);
+        if (key_sym != NoSymbol && (spare_only || !find_key_code(key_syms,
+                min_key_code, key_codes_count, key_syms_per_key_code,
+                key_sym, &key_code, &shift))) {
+            for (i = 0; i < missing_count; ++i) {
+                if (missing_key_syms[i] == key_sym) {
+                    break;
+                }
+            }
+            if (i == missing_count) {
+                if (missing_count == spare_key_codes_count) {
+                    break;
+                }
+                missing_key_syms[missing_count] = key_sym;
+                ++missing_count;
+            }
+        }
+        batch_end = next;
+    }
+
+    for (i = 0; i < spare_key_codes_count; ++i) {
+        kept[i] = FALSE;
+    }
+    for (i = 0; i < missing_count; ++i) {
+        j = find_spare_key_code(missing_key_syms[i]);
+        if (j != -1) {
+            kept[j] = TRUE;
+        }
+    }
+    for (i = 0; i < missing_count; ++i) {
+        if (find_spare_key_code(missing_key_syms[i]) != -1) {
+            continue;
+        }
+        for (j = 0; j < spare_key_codes_count; ++j) {
+            if (!kept[j] && spare_key_syms[j] == NoSymbol) {
+                break;
+            }
+        }
+        if (j == spare_key_codes_count) {
+            for (j = 0; j < spare_key_codes_count; ++j) {
+                if (!kept[j]) {
+                    break;
+                }
+            }
+            rebound = TRUE;
+        }
+        spare_key_syms[j] = missing_key_syms[i];
+        kept[j] = TRUE;
+    }
+
+    if (rebound) {
+        log_info("bind_spare_key_syms: Syncing before rebinding");
+        XSync(display, False);
+    }
+    change_spare_key_syms(key_syms_per_key_code);
+
+    return batch_end;
+}
+
+/**
+ * Returns the index of the spare key code bound to the key sym, or -1.
+ */
+static int find_spare_key_code(KeySym key_sym) {
+
+    int i;
+
+    for (i = 0; i < spare_key_codes_count; ++i) {
+        if (spare_key_syms[i] == key_sym) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Looks the key sym up in the first two columns of the core mapping,
+ * the second one needing Shift.
+ */
+static BOOL find_key_code(KeySym *key_syms, int min_key_code,
+        int key_codes_count, int key_syms_per_key_code, KeySym key_sym,
+        KeyCode *key_code, BOOL *shift) {
+
+    int i, j;
+
+    for (j = 0; j < 2 && j < key_syms_per_key_code; ++j) {
+        for (i = 0; i < key_codes_count; ++i) {
+            if (key_syms[i * key_syms_per_key_code + j] == key_sym) {
+                *key_code = min_key_code + i;
+                *shift = j == 1;
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Brings the server mapping of the spare key codes up to date, with a
+ * request per run of adjacent ones changed. Other key codes are never
+ * rewritten, since XKB servers convert every key code changed from the
+ * core mapping and clients reload their keymap for it. A spare key code
+ * gets its key sym in both of the first two columns, so that Xlib does
+ * not derive another case for Shift.
+ */
+static void change_spare_key_syms(int key_syms_per_key_code) {
+
+    KeySym *mapping;
+    int first, count, i, j;
+
+    if (spare_key_codes_count <= 0) {
+        return;
+    }
+    mapping = malloc(spare_key_codes_count * key_syms_per_key_code
+            * sizeof(KeySym));
+    if (mapping == NULL) {
+        log_error("change_spare_key_syms: malloc returned null");
+        return;
+    }
+
+    for (i = 0; i < spare_key_codes_count; ) {
+        if (spare_key_syms[i] == mapped_spare_key_syms[i]) {
+            ++i;
+            continue;
+        }
+        first = i;
+        do {
+            for (j = 0; j < key_syms_per_key_code; ++j) {
+                mapping[(i - first) * key_syms_per_key_code + j] = j < 2
+                        ? spare_key_syms[i] : NoSymbol;
+            }
+            mapped_spare_key_syms[i] = spare_key_syms[i];
+            ++i;
+        } while (i < spare_key_codes_count
+                && spare_key_codes[i] == spare_key_codes[i - 1] + 1
+                && spare_key_syms[i] != mapped_spare_key_syms[i]);
+        count = i - first;
+        log_info("change_spare_key_syms: Key codes=0x%x..0x%x",
+                spare_key_codes[first], spare_key_codes[i - 1]);
+        XChangeKeyboardMapping(display, spare_key_codes[first],
+                key_syms_per_key_code, mapping, count);
+    }
+    free(mapping);
+}
+
+/**
+ * Clears the key syms send_text() left on the spare key codes.
+ */
+static void restore_spare_key_syms() {
+
+    int min_key_code, max_key_code, key_codes_count,
+            key_syms_per_key_code, i;
+    KeySym *key_syms;
+
+    for (i = 0; i < spare_key_codes_count; ++i) {
+        if (spare_key_syms[i] != NoSymbol) {
+            break;
+        }
+    }
+    if (spare_key_codes_count <= 0 || i == spare_key_codes_count) {
+        return;
+    }
+
+    XDisplayKeycodes(display, &min_key_code, &max_key_code);
+    key_codes_count = max_key_code - min_key_code + 1;
+    key_syms = XGetKeyboardMapping(display, min_key_code,
+            key_codes_count, &key_syms_per_key_code);
+    if (key_syms == NULL) {
+        log_error("restore_spare_key_syms: XGetKeyboardMapping returned null");
+        return;
+    }
+    update_spare_key_codes(key_syms, min_key_code, key_codes_count,
+            key_syms_per_key_code);
+    for (i = 0; i < spare_key_codes_count; ++i) {
+        spare_key_syms[i] = NoSymbol;
+    }
+    change_spare_key_syms(key_syms_per_key_code);
+    XFree(key_syms);
+    XFlush(display);
+}
+
+static void log_key_stats() {
+
+    int i;
+
+    for (i = 0; i < bound_keys_count; ++i) {
+        if (bound_keys[i].handled_count == 0) {
+            continue;
+        }
+        log_info("log_key_stats: %s modifiers=0x%x, handled=%lu, X requests=%lu/%lu, round trips=%lu/%lu, flushes=%lu/%lu, bytes=%lu/%lu (total/max)",
+                XKeysymToString(bound_keys[i].key_sym),
+                bound_keys[i].modifiers, bound_keys[i].handled_count,
+                bound_keys[i].stats_total.requests,
+                bound_keys[i].stats_max.requests,
+                bound_keys[i].stats_total.round_trips,
+                bound_keys[i].stats_max.round_trips,
+                bound_keys[i].stats_total.flushes,
+                bound_keys[i].stats_max.flushes,
+                bound_keys[i].stats_total.bytes,
+                bound_keys[i].stats_max.bytes);
+    }
+}
+
+static void allow_events(BOOL replay) {
+    if (xi2_enabled) {
+        // The keyboard may have been unplugged meanwhile.
+        if (event_device_id == XIAllDevices) {
+            return;
+        }
+        XIAllowEvents(display, event_device_id,
+                replay ? XIReplayDevice : XISyncDevice, CurrentTime);
+        if (replay) {
+            grabbed_device_id = XIAllDevices;
+        }
+    } else {
+        XAllowEvents(display, replay ? ReplayKeyboard : SyncKeyboard,
+                CurrentTime);
+    }
+}
+
+/**
+ * Releases the active grab so that keys we inject are not delivered to
+ * ourselves. With XInput2, only a device whose grab is active can be
+ * ungrabbed, others get BadDevice.
+ */
+static void ungrab_keyboard() {
+    if (xi2_enabled) {
+        if (grabbed_device_id != XIAllDevices) {
+            XIUngrabDevice(display, grabbed_device_id, CurrentTime);
+            grabbed_device_id = XIAllDevices;
+        }
+    } else {
+        XUngrabKeyboard(display, CurrentTime);
+    }
+}
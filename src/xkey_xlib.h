@@ -0,0 +1,30 @@
+/**
+ * @file xkey_xlib.h
+ * @author Zhang Hai
+ */
+
+#ifndef _XKEY_XLIB_H_
+#define _XKEY_XLIB_H_
+
+#include "xkey.h"
+#include "xstats.h"
+
+/**
+ * Grabs through XInput2 or core Xlib, and injects through XTest.
+ */
+extern xkey_backend_t xkey_xlib_backend;
+
+void xkey_xlib_set_round_trip_budget(unsigned long max_round_trips);
+
+BOOL xkey_xlib_set_key_round_trip_budget(KeySym key_sym,
+        unsigned int modifiers, unsigned long max_round_trips);
+
+BOOL xkey_xlib_is_within_round_trip_budget();
+
+BOOL xkey_xlib_is_key_within_round_trip_budget(KeySym key_sym,
+        unsigned int modifiers);
+
+BOOL xkey_xlib_get_key_stats(KeySym key_sym, unsigned int modifiers,
+        xstats_t *max_stats);
+
+#endif /* _XKEY_XLIB_H_ */
@@ -0,0 +1,99 @@
+/**
+ * @file xstats.c
+ * @author Zhang Hai
+ */
+
+#include "xstats.h"
+
+#include <X11/Xlibint.h>
+
+static int after_function(Display *display);
+static void sample();
+
+static Display *display = NULL;
+static int (*previous_after_function)(Display *display) = NULL;
+
+static xstats_t counters;
+static unsigned long sampled_request = 0;
+static unsigned long sampled_pending = 0;
+
+/**
+ * Counts X protocol traffic on the display by sampling it after every
+ * Xlib request function through XSetAfterFunction().
+ *
+ * Requests are exact, from sequence numbers. A round trip is a request
+ * whose reply has been read by the time its function returns, which
+ * also implies a flush. Other flushes and bytes are derived from the
+ * output buffer, so several flushes between two samples count as one,
+ * and the bytes of a request flushed by its own round trip are missed.
+ */
+void xstats_initialize(Display *counted_display) {
+    display = counted_display;
+    sampled_request = LastKnownRequestProcessed(display);
+    previous_after_function = XSetAfterFunction(display, after_function);
+}
+
+void xstats_get(xstats_t *stats) {
+    if (display != NULL) {
+        sample();
+    }
+    *stats = counters;
+}
+
+void xstats_subtract(xstats_t *stats, xstats_t *since) {
+    stats->requests -= since->requests;
+    stats->round_trips -= since->round_trips;
+    stats->flushes -= since->flushes;
+    stats->bytes -= since->bytes;
+}
+
+void xstats_add(xstats_t *stats, xstats_t *delta) {
+    stats->requests += delta->requests;
+    stats->round_trips += delta->round_trips;
+    stats->flushes += delta->flushes;
+    stats->bytes += delta->bytes;
+}
+
+void xstats_max(xstats_t *stats, xstats_t *other) {
+#define XSTATS_MAX(field) if (other->field > stats->field) stats->field = other->field
+    XSTATS_MAX(requests);
+    XSTATS_MAX(round_trips);
+    XSTATS_MAX(flushes);
+    XSTATS_MAX(bytes);
+#undef XSTATS_MAX
+}
+
+/**
+ * Must not issue any request, Xlib calls this after each of them.
+ */
+static int after_function(Display *display) {
+    sample();
+    return previous_after_function != NULL
+            ? previous_after_function(display) : 0;
+}
+
+static void sample() {
+
+    unsigned long request = NextRequest(display) - 1;
+    unsigned long pending = display->bufptr - display->buffer;
+    Bool round_trip = False;
+
+    if (request != sampled_request) {
+        counters.requests += request - sampled_request;
+        // Only a reply or an error brings the processed sequence
+        // number up to the request we have just sent.
+        round_trip = LastKnownRequestProcessed(display) == request;
+        if (round_trip) {
+            ++counters.round_trips;
+        }
+        sampled_request = request;
+    }
+
+    if (pending < sampled_pending || round_trip) {
+        ++counters.flushes;
+        counters.bytes += pending;
+    } else {
+        counters.bytes += pending - sampled_pending;
+    }
+    sampled_pending = pending;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file xstats.h
+ * @author Zhang Hai
+ */
+
+#ifndef _XSTATS_H_
+#define _XSTATS_H_
+
+#include <X11/Xlib.h>
+
+typedef struct {
+    unsigned long requests;
+    unsigned long round_trips;
+    unsigned long flushes;
+    unsigned long bytes;
+} xstats_t;
+
+void xstats_initialize(Display *display);
+
+void xstats_get(xstats_t *stats);
+
+void xstats_subtract(xstats_t *stats, xstats_t *since);
+
+void xstats_add(xstats_t *stats, xstats_t *delta);
+
+void xstats_max(xstats_t *stats, xstats_t *other);
+
+#endif /* _XSTATS_H_ */
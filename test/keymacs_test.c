@@ -0,0 +1,326 @@
+/**
+ * @file keymacs_test.c
+ * @author Zhang Hai
+ *
+ * Drives the keymacs bindings through the fake xkey backend, no X
+ * server needed. Build and run from this directory with:
+ *
+ *     gcc -I../src -o keymacs_test keymacs_test.c ../src/keymacs.c \
+ *             ../src/xkey.c ../src/xkey_fake.c ../src/recorder.c \
+ *             ../src/log.c -lX11 && ./keymacs_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "keymacs.h"
+#include "xkey_fake.h"
+
+// Key events handled by test_stress(), well past XKEY_FAKE_SENT_KEYS_MAX.
+#define STRESS_ITERATIONS 10000
+
+static void test_navigation();
+static void test_lock_modifiers();
+static void test_pass_through();
+static void test_control_x_mode();
+static void test_sent_keys();
+static void test_text_key_syms();
+static void test_send_text();
+static void test_stress();
+static void expect_key(KeySym key_sym, unsigned int modifiers,
+        int decision);
+static void expect_sent_keys(xkey_fake_key_t *keys, unsigned int count);
+static void expect_text_key_syms(char *text, KeySym *key_syms,
+        unsigned int count);
+
+static char *test_name;
+static unsigned int failed_count = 0;
+
+int main() {
+
+    xkey_use_backend(&xkey_fake_backend);
+    xkey_initialize();
+    keymacs_on_bind_key();
+
+    test_navigation();
+    test_lock_modifiers();
+    test_pass_through();
+    test_control_x_mode();
+    test_sent_keys();
+    test_text_key_syms();
+    test_send_text();
+    test_stress();
+
+    xkey_finalize();
+
+    if (failed_count > 0) {
+        printf("%u failed\n", failed_count);
+        return EXIT_FAILURE;
+    }
+    printf("All passed\n");
+    return EXIT_SUCCESS;
+}
+
+static void test_navigation() {
+
+    xkey_fake_key_t right[] = { { XK_Right, 0 } };
+
+    test_name = "navigation";
+    xkey_fake_clear_sent_keys();
+    expect_key(XK_F, ControlMask, XKEY_FAKE_SYNC);
+    expect_sent_keys(right, 1);
+    // Releases are swallowed without sending anything.
+    xkey_fake_handle_key(XK_F, ControlMask, FALSE);
+    expect_sent_keys(right, 1);
+    expect_key(XK_Q, ControlMask, XKEY_FAKE_UNHANDLED);
+    // Bound for C-x mode only.
+    expect_key(XK_H, 0, XKEY_FAKE_REPLAY);
+}
+
+static void test_lock_modifiers() {
+
+    xkey_fake_key_t left[] = { { XK_Left, 0 } };
+
+    test_name = "lock modifiers";
+    xkey_fake_clear_sent_keys();
+    expect_key(XK_B, ControlMask | LockMask | NumLockMask,
+            XKEY_FAKE_SYNC);
+    expect_sent_keys(left, 1);
+}
+
+static void test_pass_through() {
+
+    xkey_fake_key_t right[] = { { XK_Right, 0 } };
+
+    test_name = "M-x pass through";
+    xkey_fake_clear_sent_keys();
+    expect_key(XK_X, AltMask, XKEY_FAKE_SYNC);
+    expect_key(XK_F, ControlMask, XKEY_FAKE_PASS_THROUGH);
+    expect_sent_keys(NULL, 0);
+    expect_key(XK_F, ControlMask, XKEY_FAKE_SYNC);
+    expect_sent_keys(right, 1);
+}
+
+static void test_control_x_mode() {
+
+    xkey_fake_key_t keys[] = {
+            { XK_O, ControlMask },
+            { XK_Right, 0 },
+            { XK_A, ControlMask }
+    };
+
+    test_name = "C-x mode";
+    xkey_fake_clear_sent_keys();
+    expect_key(XK_X, ControlMask, XKEY_FAKE_SYNC);
+    expect_sent_keys(NULL, 0);
+    expect_key(XK_F, ControlMask, XKEY_FAKE_SYNC);
+    expect_sent_keys(keys, 1);
+    // Left after a single key.
+    expect_key(XK_F, ControlMask, XKEY_FAKE_SYNC);
+    expect_sent_keys(keys, 2);
+    expect_key(XK_X, ControlMask, XKEY_FAKE_SYNC);
+    expect_key(XK_H, 0, XKEY_FAKE_SYNC);
+    expect_sent_keys(keys, 3);
+    // C-g quits C-x mode.
+    expect_key(XK_X, ControlMask, XKEY_FAKE_SYNC);
+    expect_key(XK_G, ControlMask, XKEY_FAKE_SYNC);
+    expect_key(XK_H, 0, XKEY_FAKE_REPLAY);
+    expect_sent_keys(keys, 3);
+}
+
+static void test_sent_keys() {
+
+    xkey_fake_key_t keys[] = {
+            { XK_X, ControlMask },
+            { XK_End, ShiftMask },
+            { XK_Delete, 0 },
+            { XK_Right, ShiftMask },
+            { XK_X, ControlMask }
+    };
+
+    test_name = "sent keys";
+    xkey_fake_clear_sent_keys();
+    expect_key(XK_W, ControlMask, XKEY_FAKE_SYNC);
+    expect_key(XK_K, ControlMask, XKEY_FAKE_SYNC);
+    // C-Space selects until toggled again.
+    expect_key(XK_space, ControlMask, XKEY_FAKE_SYNC);
+    expect_key(XK_F, ControlMask, XKEY_FAKE_SYNC);
+    expect_key(XK_K, ControlMask, XKEY_FAKE_SYNC);
+    expect_key(XK_space, ControlMask, XKEY_FAKE_SYNC);
+    expect_sent_keys(keys, 5);
+}
+
+static void test_text_key_syms() {
+
+    KeySym ascii[] = { XK_H, XK_i, XK_space, XK_asciitilde };
+    KeySym multibyte[] = {
+            XK_eacute, 0x010020ac, 0x0101f600, 0x01000100
+    };
+    KeySym truncated[] = { NoSymbol, XK_A, NoSymbol };
+    KeySym malformed[] = { NoSymbol, NoSymbol, XK_B, NoSymbol };
+    KeySym control[] = {
+            XK_Return, XK_Tab, NoSymbol, NoSymbol, NoSymbol, XK_nobreakspace
+    };
+
+    test_name = "text key syms";
+    expect_text_key_syms("Hi ~", ascii, 4);
+    // U+00E9, U+20AC, U+1F600 and U+0100.
+    expect_text_key_syms("\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\xc4\x80",
+            multibyte, 4);
+    // A three byte sequence cut short, before a character and at the
+    // end.
+    expect_text_key_syms("\xe2\x82" "A\xe2\x82", truncated, 3);
+    // A stray continuation byte and an invalid lead byte.
+    expect_text_key_syms("\x80\xff" "B\xc3", malformed, 4);
+    // Newline, tab, C0, DEL, C1 and U+00A0.
+    expect_text_key_syms("\n\t\x01\x7f\xc2\x85\xc2\xa0", control, 6);
+}
+
+static void test_send_text() {
+
+    xkey_fake_key_t keys[] = {
+            { XK_H, 0 },
+            { XK_i, 0 },
+            { XK_Return, 0 },
+            { XK_eacute, 0 },
+            { 0x010020ac, 0 }
+    };
+
+    test_name = "send text";
+    xkey_fake_clear_sent_keys();
+    // The C0 control character is dropped.
+    xkey_send_text("Hi\n\x01\xc3\xa9\xe2\x82\xac");
+    expect_sent_keys(keys, 5);
+    xkey_fake_clear_sent_keys();
+    xkey_send_text("");
+    expect_sent_keys(NULL, 0);
+}
+
+/**
+ * Alternates C-f and C-k many times, checking every decision and the
+ * number of keys sent. Only the first XKEY_FAKE_SENT_KEYS_MAX of them
+ * are kept.
+ */
+static void test_stress() {
+
+    xkey_fake_key_t *sent_keys;
+    unsigned int sent_keys_count, wrong_count = 0;
+    unsigned long expected_total = 0;
+    int i;
+
+    test_name = "stress";
+    xkey_fake_clear_sent_keys();
+    for (i = 0; i < STRESS_ITERATIONS; ++i) {
+        if (xkey_fake_handle_key(XK_F, ControlMask, TRUE)
+                != XKEY_FAKE_SYNC) {
+            ++wrong_count;
+        }
+        xkey_fake_handle_key(XK_F, ControlMask, FALSE);
+        // Shift + End and Delete without a selection.
+        if (xkey_fake_handle_key(XK_K, ControlMask, TRUE)
+                != XKEY_FAKE_SYNC) {
+            ++wrong_count;
+        }
+        xkey_fake_handle_key(XK_K, ControlMask, FALSE);
+        expected_total += 3;
+    }
+    if (wrong_count > 0) {
+        printf("%s: %u wrong decisions\n", test_name, wrong_count);
+        ++failed_count;
+    }
+    if (xkey_fake_get_sent_keys_total() != expected_total) {
+        printf("%s: Expected %lu keys sent, got %lu\n", test_name,
+                expected_total, xkey_fake_get_sent_keys_total());
+        ++failed_count;
+    }
+
+    sent_keys = xkey_fake_get_sent_keys(&sent_keys_count);
+    if (sent_keys_count != XKEY_FAKE_SENT_KEYS_MAX) {
+        printf("%s: Expected %d keys kept, got %u\n", test_name,
+                XKEY_FAKE_SENT_KEYS_MAX, sent_keys_count);
+        ++failed_count;
+        return;
+    }
+    for (i = 0; i < sent_keys_count; ++i) {
+        if (sent_keys[i].key_sym != (i % 3 == 0 ? XK_Right
+                : i % 3 == 1 ? XK_End : XK_Delete)) {
+            printf("%s: Unexpected key %d kept: %s\n", test_name, i,
+                    XKeysymToString(sent_keys[i].key_sym));
+            ++failed_count;
+            return;
+        }
+    }
+}
+
+/**
+ * Presses the key and checks what became of it.
+ */
+static void expect_key(KeySym key_sym, unsigned int modifiers,
+        int decision) {
+
+    int actual_decision = xkey_fake_handle_key(key_sym, modifiers, TRUE);
+
+    if (actual_decision != decision) {
+        printf("%s: %s modifiers=0x%x, expected decision %d, got %d\n",
+                test_name, XKeysymToString(key_sym), modifiers, decision,
+                actual_decision);
+        ++failed_count;
+    }
+}
+
+/**
+ * Checks every key sent since the last xkey_fake_clear_sent_keys().
+ */
+static void expect_sent_keys(xkey_fake_key_t *keys, unsigned int count) {
+
+    xkey_fake_key_t *sent_keys;
+    unsigned int sent_keys_count;
+    int i;
+
+    sent_keys = xkey_fake_get_sent_keys(&sent_keys_count);
+    if (sent_keys_count != count) {
+        printf("%s: Expected %u keys sent, got %u\n", test_name, count,
+                sent_keys_count);
+        ++failed_count;
+        return;
+    }
+    for (i = 0; i < count; ++i) {
+        if (sent_keys[i].key_sym != keys[i].key_sym
+                || sent_keys[i].modifiers != keys[i].modifiers) {
+            printf("%s: Expected key %d sent %s modifiers=0x%x, got %s modifiers=0x%x\n",
+                    test_name, i, XKeysymToString(keys[i].key_sym),
+                    keys[i].modifiers,
+                    XKeysymToString(sent_keys[i].key_sym),
+                    sent_keys[i].modifiers);
+            ++failed_count;
+        }
+    }
+}
+
+/**
+ * Decodes the whole text and checks every key sym, NoSymbol included.
+ */
+static void expect_text_key_syms(char *text, KeySym *key_syms,
+        unsigned int count) {
+
+    char *next = text;
+    KeySym key_sym;
+    int i;
+
+    for (i = 0; *next != '\0'; ++i) {
+        key_sym = xkey_next_text_key_sym(&next);
+        if (i >= count) {
+            continue;
+        }
+        if (key_sym != key_syms[i]) {
+            printf("%s: Expected key sym %d of \"%s\" 0x%lx, got 0x%lx\n",
+                    test_name, i, text, key_syms[i], key_sym);
+            ++failed_count;
+        }
+    }
+    if (i != count) {
+        printf("%s: Expected %u key syms in \"%s\", got %d\n", test_name,
+                count, text, i);
+        ++failed_count;
+    }
+}
@@ -0,0 +1,254 @@
+/**
+ * @file xlib_budget_test.c
+ * @author Zhang Hai
+ *
+ * Drives the keymacs bindings through the Xlib backend on a scratch X
+ * server, and checks the round trips each binding takes against its
+ * budget. Keys are faked through the XTest keyboard of a master device
+ * of our own, which is the only keyboard grabbed. Build and run from
+ * this directory with:
+ *
+ *     gcc -I../src -o xlib_budget_test xlib_budget_test.c \
+ *             ../src/keymacs.c ../src/xkey.c ../src/xkey_xlib.c \
+ *             ../src/xstats.c ../src/recorder.c ../src/log.c \
+ *             -lX11 -lXi -lXtst
+ *     Xvfb :99 & DISPLAY=:99 ./xlib_budget_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <X11/extensions/XInput2.h>
+#include <X11/extensions/XTest.h>
+
+#include "keymacs.h"
+#include "xkey_xlib.h"
+
+#define TEST_MASTER_NAME "xkeymacs-test"
+#define TEST_KEYBOARD_NAME TEST_MASTER_NAME " XTEST keyboard"
+
+typedef struct {
+    KeySym key_sym;
+    unsigned int modifiers;
+    unsigned long max_round_trips;
+} budget_key_t;
+
+static unsigned int test_keys();
+static BOOL add_test_master();
+static void remove_test_master();
+static int find_master(char *name);
+static void press_key(KeySym key_sym, unsigned int modifiers);
+static void fake_key(KeySym key_sym, Bool press);
+
+static Display *test_display;
+
+int main() {
+
+    unsigned int failed_count;
+
+    test_display = XOpenDisplay(NULL);
+    if (test_display == NULL) {
+        printf("Cannot open display, run under Xvfb\n");
+        return EXIT_FAILURE;
+    }
+    if (!add_test_master()) {
+        XCloseDisplay(test_display);
+        return EXIT_FAILURE;
+    }
+
+    xkey_use_backend(&xkey_xlib_backend);
+    xkey_select_device(TEST_KEYBOARD_NAME);
+    xkey_initialize();
+    keymacs_on_bind_key();
+
+    failed_count = test_keys();
+
+    xkey_finalize();
+    remove_test_master();
+    XCloseDisplay(test_display);
+
+    if (failed_count > 0) {
+        printf("%u failed\n", failed_count);
+        return EXIT_FAILURE;
+    }
+    printf("All passed\n");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Presses every key in turn, then checks what it took. Returns the
+ * number of failures. AltMask is only known after xkey_initialize().
+ */
+static unsigned int test_keys() {
+
+    // One round trip per key sent, querying the modifier states.
+    budget_key_t keys[] = {
+            { XK_F, ControlMask, 1 },
+            { XK_B, ControlMask, 1 },
+            { XK_P, ControlMask, 1 },
+            { XK_N, ControlMask, 1 },
+            { XK_A, ControlMask, 1 },
+            { XK_E, ControlMask, 1 },
+            { XK_V, ControlMask, 1 },
+            { XK_V, AltMask, 1 },
+            { XK_comma, AltMask | ShiftMask, 1 },
+            { XK_period, AltMask | ShiftMask, 1 },
+            { XK_F, AltMask, 1 },
+            { XK_B, AltMask, 1 },
+            { XK_W, ControlMask, 1 },
+            { XK_W, AltMask, 1 },
+            { XK_Y, ControlMask, 1 },
+            { XK_D, ControlMask, 1 },
+            { XK_D, AltMask, 1 },
+            { XK_K, ControlMask, 2 },
+            { XK_slash, ControlMask, 1 },
+            { XK_S, ControlMask, 1 },
+            { XK_R, ControlMask, 1 },
+            { XK_M, ControlMask, 1 },
+            { XK_J, ControlMask, 1 },
+            // Toggled on and off again.
+            { XK_space, ControlMask, 0 },
+            { XK_space, ControlMask, 0 },
+            { XK_G, ControlMask, 0 },
+            // Replayed in normal mode.
+            { XK_K, 0, 0 },
+            { XK_X, ControlMask, 0 },
+            { XK_H, 0, 1 },
+            // Last, since the grabs stay lifted for the key after it.
+            { XK_X, AltMask, 1 }
+    };
+    unsigned int keys_count = sizeof(keys) / sizeof(keys[0]);
+    unsigned int failed_count = 0;
+    xstats_t stats;
+    int i;
+
+    for (i = 0; i < keys_count; ++i) {
+        xkey_xlib_set_key_round_trip_budget(keys[i].key_sym,
+                keys[i].modifiers, keys[i].max_round_trips);
+    }
+
+    for (i = 0; i < keys_count; ++i) {
+        press_key(keys[i].key_sym, keys[i].modifiers);
+    }
+
+    for (i = 0; i < keys_count; ++i) {
+        if (!xkey_xlib_get_key_stats(keys[i].key_sym, keys[i].modifiers,
+                &stats)) {
+            printf("%s modifiers=0x%x: Not bound\n",
+                    XKeysymToString(keys[i].key_sym), keys[i].modifiers);
+            ++failed_count;
+        } else if (stats.requests == 0) {
+            // Every key handled at least allows events.
+            printf("%s modifiers=0x%x: Never handled\n",
+                    XKeysymToString(keys[i].key_sym), keys[i].modifiers);
+            ++failed_count;
+        } else if (!xkey_xlib_is_key_within_round_trip_budget(
+                keys[i].key_sym, keys[i].modifiers)) {
+            printf("%s modifiers=0x%x: %lu round trips, budget %lu\n",
+                    XKeysymToString(keys[i].key_sym), keys[i].modifiers,
+                    stats.round_trips, keys[i].max_round_trips);
+            ++failed_count;
+        }
+    }
+
+    return failed_count;
+}
+
+/**
+ * Adds a master device pair and makes it ours, so that keys we fake
+ * come from its XTest keyboard instead of the one xkeymacs injects
+ * through.
+ */
+static BOOL add_test_master() {
+
+    XIAnyHierarchyChangeInfo change;
+    int pointer_id;
+
+    change.add.type = XIAddMaster;
+    change.add.name = TEST_MASTER_NAME;
+    change.add.send_core = True;
+    change.add.enable = True;
+    XIChangeHierarchy(test_display, &change, 1);
+    XSync(test_display, False);
+
+    pointer_id = find_master(TEST_MASTER_NAME " pointer");
+    if (pointer_id == -1) {
+        printf("Cannot add master device %s\n", TEST_MASTER_NAME);
+        return FALSE;
+    }
+    XISetClientPointer(test_display, None, pointer_id);
+    XSync(test_display, False);
+    return TRUE;
+}
+
+static void remove_test_master() {
+
+    XIAnyHierarchyChangeInfo change;
+    int pointer_id = find_master(TEST_MASTER_NAME " pointer");
+
+    if (pointer_id == -1) {
+        return;
+    }
+    change.remove.type = XIRemoveMaster;
+    change.remove.deviceid = pointer_id;
+    change.remove.return_mode = XIFloating;
+    XIChangeHierarchy(test_display, &change, 1);
+    XSync(test_display, False);
+}
+
+/**
+ * Returns -1 if no master device has the given name.
+ */
+static int find_master(char *name) {
+
+    XIDeviceInfo *device_infos;
+    int i, device_infos_count, device_id = -1;
+
+    device_infos = XIQueryDevice(test_display, XIAllMasterDevices,
+            &device_infos_count);
+    for (i = 0; i < device_infos_count; ++i) {
+        if (strcmp(device_infos[i].name, name) == 0) {
+            device_id = device_infos[i].deviceid;
+            break;
+        }
+    }
+    XIFreeDeviceInfo(device_infos);
+    return device_id;
+}
+
+/**
+ * Types the key with the modifiers held, and has xkeymacs handle every
+ * event it causes.
+ */
+static void press_key(KeySym key_sym, unsigned int modifiers) {
+
+    if (modifiers & ControlMask) {
+        fake_key(XK_Control_L, True);
+    }
+    if (modifiers & AltMask) {
+        fake_key(XK_Alt_L, True);
+    }
+    if (modifiers & ShiftMask) {
+        fake_key(XK_Shift_L, True);
+    }
+    fake_key(key_sym, True);
+    fake_key(key_sym, False);
+    if (modifiers & ShiftMask) {
+        fake_key(XK_Shift_L, False);
+    }
+    if (modifiers & AltMask) {
+        fake_key(XK_Alt_L, False);
+    }
+    if (modifiers & ControlMask) {
+        fake_key(XK_Control_L, False);
+    }
+    XSync(test_display, False);
+
+    xkey_process_pending();
+}
+
+static void fake_key(KeySym key_sym, Bool press) {
+    XTestFakeKeyEvent(test_display, XKeysymToKeycode(test_display,
+            key_sym), press, CurrentTime);
+}